@@ -9,13 +9,27 @@
 #include <linux/kernel.h>
 #include <linux/mm.h>
 #include <linux/poll.h>
-#include <linux/cleancache.h>
 #include <linux/pfn.h>
-#include <asm/uaccess.h>
+#include <linux/pfn_t.h>
+#include <linux/dma-mapping.h>
+#include <linux/hrtimer.h>
+#include <linux/slab.h>
+#include <linux/moduleparam.h>
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/eventfd.h>
+#include <linux/io_uring.h>
+#include <linux/uaccess.h>
 #include <asm/pgalloc.h>
 
 #include "dragon.h"
 
+#define CREATE_TRACE_POINTS
+#include "dragon_trace.h"
+
 MODULE_LICENSE("Dual BSD/GPL");
 
 #define DRAGON_VID      0x10EE
@@ -33,16 +47,67 @@ MODULE_LICENSE("Dual BSD/GPL");
 #define DRAGON_DEFAULT_CHANNEL 0
 #define DRAGON_DEFAULT_SYNC_OFFSET 0
 #define DRAGON_DEFAULT_SYNC_WIDTH 50
+// largest allocation order of a buffer chunk
 #define DRAGON_BUFFER_ORDER 10
+// largest single device transfer, bounded by the width of reg 6
+#define DRAGON_MAX_CHUNK_PACKETS DRAGON_MAX_FRAMES_PER_BUFFER
 #define DRAGON_DEFAULT_DAC_DATA 0xFFFFFFFF
 #define DRAGON_DEFAULT_ADC_TYPE 0
 #define DRAGON_DEFAULT_BOARD_TYPE 0
 
+// IRQ-to-DQBUF latency histogram: bucket n counts latencies below 2^n us
+#define DRAGON_LATENCY_BUCKETS 24
+
+// completed buffers handled per dequeue pass
+#define DRAGON_DQBUF_BATCH 64
+// buffers kept queued in overwrite mode: the one being filled and the next
+#define DRAGON_OVERWRITE_MIN_QUEUED 2
+// FPGA reset assert time; no status bit is known to signal its end
+#define DRAGON_RESET_MS 100
+
+#define DRAGON_EMU_MAXNUM_DEVS 16
+#define DRAGON_EMU_REG_COUNT 16
+#define DRAGON_EMU_ID 0x454D5531 // "EMU1"
+#define DRAGON_EMU_DEFAULT_SAMPLE_RATE 50000000
+
 static const char DRV_NAME[] = "dragon";
 static struct class *dragon_class;
+static struct dentry *dragon_debugfs_root;
 static dev_t dragon_dev_number;
 DEFINE_SPINLOCK(dev_number_lock);
 
+static unsigned int dragon_emulate = 0;
+module_param_named(emulate, dragon_emulate, uint, S_IRUGO);
+MODULE_PARM_DESC(emulate, "Number of software-emulated dragon devices to create");
+
+static unsigned int dragon_emu_sample_rate = DRAGON_EMU_DEFAULT_SAMPLE_RATE;
+module_param_named(emu_sample_rate, dragon_emu_sample_rate, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(emu_sample_rate, "Emulated ADC sample rate, ticks per second");
+
+static bool dragon_emu_fill = 1;
+module_param_named(emu_fill, dragon_emu_fill, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(emu_fill, "Fill emulated buffers with synthetic packets (0 - only raise completions)");
+
+static unsigned int dragon_coalesce_count = 1;
+module_param_named(coalesce_count, dragon_coalesce_count, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(coalesce_count, "Wake up consumers after this many completed buffers");
+
+static unsigned int dragon_coalesce_usecs = 0;
+module_param_named(coalesce_usecs, dragon_coalesce_usecs, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(coalesce_usecs, "Wake up consumers at least this often while buffers complete (0 - by coalesce_count only)");
+
+static unsigned int dragon_pool_chunks = 0;
+module_param_named(pool_chunks, dragon_pool_chunks, uint, S_IRUGO);
+MODULE_PARM_DESC(pool_chunks, "Buffer chunks to reserve per device at probe, up to 512 (0 - allocate on request)");
+
+static unsigned int dragon_pool_order = DRAGON_BUFFER_ORDER;
+module_param_named(pool_order, dragon_pool_order, uint, S_IRUGO);
+MODULE_PARM_DESC(pool_order, "Allocation order of reserved chunks, up to 10 (4 MiB)");
+
+static unsigned int dragon_reconfig_timeout_ms = 0;
+module_param_named(reconfig_timeout_ms, dragon_reconfig_timeout_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(reconfig_timeout_ms, "Give up a buffer layout change if the device queue hasn't drained by then, 0 - wait until drained or stopped (default)");
+
 
 static const struct pci_device_id dragon_ids[] = {
     { PCI_DEVICE(DRAGON_VID, DRAGON_DID) },
@@ -51,18 +116,74 @@ static const struct pci_device_id dragon_ids[] = {
 
 MODULE_DEVICE_TABLE(pci, dragon_ids);
 
+struct dragon_private;
+
+// One device transfer of a buffer: physically contiguous, mapped separately
+typedef struct dragon_chunk
+{
+    void* ptr;
+    dma_addr_t dma_handle;
+} dragon_chunk;
+
 typedef struct dragon_buffer_opaque
 {
     dragon_buffer buf;
-    dma_addr_t dma_handle;
-    struct list_head qlist;
-    struct list_head dqlist;
+    dragon_chunk chunks[DRAGON_MAX_CHUNKS_PER_BUFFER];
     atomic_t owned_by_cpu;
+    atomic_t queued;            // the driver's from QBUF until it's dequeued
+    struct dragon_private *private;
+    atomic_t stream_refs;       // read()/splice() users; requeued on the last put
+    struct file *stream_file;   // held by every page lent to a pipe
 } dragon_buffer_opaque;
 
+// Single-producer/single-consumer ring of buffer indices; head and tail are
+// free-running and live on separate cache lines
+typedef struct dragon_index_ring
+{
+    uint32_t head ____cacheline_aligned_in_smp;
+    uint32_t tail ____cacheline_aligned_in_smp;
+    uint16_t idx[DRAGON_MAX_BUFFER_COUNT];
+} dragon_index_ring;
+
+typedef struct dragon_stats
+{
+    atomic64_t irqs;
+    atomic64_t completed;
+    atomic64_t underruns;
+    atomic64_t overwrites;
+    atomic64_t dqbuf_eagain;
+    atomic64_t sync_cpu_ns;
+    atomic64_t sync_cpu_count;
+    uint32_t peak_queue_length;
+    atomic64_t latency[DRAGON_LATENCY_BUCKETS];
+} dragon_stats;
+
+// Software stand-in for the FPGA: keeps a shadow of the register file and
+// a FIFO of DMA addresses, takes them off at the sample rate from an hrtimer
+// and fills and "completes" them from irq_work
+typedef struct dragon_emu
+{
+    struct dragon_private *private;
+    struct hrtimer timer;
+    struct work_struct irq_work;
+    spinlock_t lock;
+    uint32_t regs[DRAGON_EMU_REG_COUNT];
+    uint32_t fifo[DRAGON_MAX_BUFFER_COUNT];
+    unsigned int fifo_head;
+    unsigned int fifo_count;
+    uint32_t done[DRAGON_MAX_BUFFER_COUNT]; // transferred, not yet completed
+    unsigned int done_head;
+    unsigned int done_count;
+    uint32_t last_done;
+    uint32_t frame_counter;
+    int running;
+    int armed;
+} dragon_emu;
+
 typedef struct dragon_private
 {
     struct pci_dev *pci_dev;
+    dragon_emu *emu;
     struct cdev cdev;
     dev_t cdev_no;
     char dev_name[10];
@@ -70,18 +191,115 @@ typedef struct dragon_private
     atomic_t dev_available;
     atomic_t queue_length;
     dragon_params params;
+    uint32_t chunks;            // device transfers per buffer for current params
+    uint32_t chunk_size;        // bytes per device transfer for current params
     dragon_buffer_opaque *buffers;
     size_t buf_count;
-    struct list_head *qlist_head;
-    struct list_head *dqlist_head;
-    spinlock_t lists_lock;
+    uint32_t buf_chunks;        // layout the buffers were allocated with
+    uint32_t buf_chunk_size;    // bytes synced per chunk
+    uint32_t buf_order;         // allocation order of every chunk
+    int buf_coherent;           // coherent DMA memory, no cache syncs needed
+    int buf_pooled;             // chunks taken from the reserved pool
+    int buf_node;               // NUMA node the buffers were requested on
+    int buf_strict_node;        // buf_node was asked for explicitly: no fallback
+    int buf_mem_node;           // node the pages are on, NUMA_NO_NODE if several
+    int dev_node;               // NUMA node of the board, NUMA_NO_NODE if unknown
+    dragon_chunk *pool;         // chunks reserved and mapped at probe
+    size_t pool_count;
+    size_t pool_next;           // first pool chunk not used by buffers
+    uint32_t pool_order;
+    size_t buf_chunk_alloc;     // bytes allocated and mapped per chunk
+    size_t buf_map_size;        // bytes every buffer takes in the mmap() area
+    struct mutex map_lock;      // keeps buffers in place for mmap() faults
+    struct address_space *mapping; // of the file buffers were mmap()ed through
+    uint32_t head_chunk;        // chunks of the oldest queued buffer already done
+    dragon_index_ring qring;    // queued to device: ioctl/requeue -> IRQ
+    dragon_index_ring dqring;   // completed: IRQ -> DQBUF
+    dragon_index_ring hold;     // queued while a reconfiguration is pending
+    int reconfig_pending;       // apply reconfig_params once the device idles
+    struct mutex reconfig_lock; // one DRAGON_RECONFIGURE at a time
+    dragon_params reconfig_params;
+    spinlock_t submit_lock;     // serializes qring producers and reg 2 writes
+    spinlock_t dequeue_lock;    // serializes dqring consumers, never taken in IRQ
     spinlock_t page_table_lock;
     wait_queue_head_t wait;
     int activity;
-    spinlock_t activity_lock;
+    struct mutex activity_lock;
+    dragon_ring *ring;
+    int ring_mode;
+    struct mutex requeue_lock;  // serializes requeue ring consumers
+    int ring_rejected;          // requeue ring had invalid entries
+    int overwrite_mode;         // requeue the oldest completed buffer instead of running dry
+    struct mutex read_lock;     // serializes read() and splice_read()
+    dragon_buffer_opaque *read_buf; // buffer being streamed, 0 if none
+    size_t read_pos;
+    atomic_t stream_buffers;    // buffers held by readers or pipes
+    atomic_t irq_pending;       // MSIs taken since the completion thread ran
+    uint64_t irq_ns;            // time of the latest MSI
+    uint64_t sequence;          // next completion sequence number
+    uint32_t last_done;         // reg 2 as seen by the last completion pass
+    atomic_t wake_pending;      // completions not yet reported to waiters
+    ktime_t last_wake;
+    struct hrtimer wake_timer;
+    struct eventfd_ctx *eventfd; // signalled with the number of completions
+    spinlock_t eventfd_lock;
+    spinlock_t uring_lock;
+    struct list_head uring_cmds; // DQBUF_MULTI commands waiting for buffers
+    struct delayed_work uring_timeout; // retries them when one times out
+    dragon_stats stats;
+    struct dentry *debugfs_dir;
 } dragon_private;
 
 
+static inline uint32_t dragon_index_ring_count(dragon_index_ring *ring)
+{
+    return smp_load_acquire(&ring->head) - smp_load_acquire(&ring->tail);
+}
+
+static inline int dragon_index_ring_push(dragon_index_ring *ring, uint16_t idx)
+{
+    uint32_t head = ring->head;
+
+    if (head - smp_load_acquire(&ring->tail) >= DRAGON_MAX_BUFFER_COUNT)
+        return -ENOSPC;
+
+    ring->idx[head & (DRAGON_MAX_BUFFER_COUNT - 1)] = idx;
+    smp_store_release(&ring->head, head + 1);
+
+    return 0;
+}
+
+static inline int dragon_index_ring_peek(dragon_index_ring *ring, uint16_t *idx)
+{
+    uint32_t tail = ring->tail;
+
+    if (tail == smp_load_acquire(&ring->head))
+        return -EAGAIN;
+
+    *idx = ring->idx[tail & (DRAGON_MAX_BUFFER_COUNT - 1)];
+
+    return 0;
+}
+
+static inline int dragon_index_ring_pop(dragon_index_ring *ring, uint16_t *idx)
+{
+    uint32_t tail = ring->tail;
+
+    if (tail == smp_load_acquire(&ring->head))
+        return -EAGAIN;
+
+    *idx = ring->idx[tail & (DRAGON_MAX_BUFFER_COUNT - 1)];
+    smp_store_release(&ring->tail, tail + 1);
+
+    return 0;
+}
+
+static inline void dragon_index_ring_reset(dragon_index_ring *ring)
+{
+    ring->head = 0;
+    ring->tail = 0;
+}
+
 static void dragon_params_set_defaults(dragon_params* params)
 {
     params->frame_length      = DRAGON_DEFAULT_FRAME_LENGTH;
@@ -100,8 +318,39 @@ static void dragon_params_set_defaults(dragon_params* params)
     //params->board_type        = DRAGON_DEFAULT_BOARD_TYPE;
 }
 
+// Split a buffer into the smallest number of equal device transfers
+// ("chunks") of whole frames that fit the device. Chunks of a multi-chunk
+// buffer must be page multiples so that it stays contiguous in userspace.
+static int dragon_buffer_layout(const dragon_params* params,
+                                uint32_t *chunks, uint32_t *chunk_size)
+{
+    uint32_t frame_packets = params->frame_length/DRAGON_DATA_PER_PACKET;
+    uint32_t n, packets;
+
+    for (n = 1; n <= DRAGON_MAX_CHUNKS_PER_BUFFER; n++)
+    {
+        if (params->frames_per_buffer % n)
+            continue;
+
+        packets = params->frames_per_buffer/n*frame_packets;
+        if (packets > DRAGON_MAX_CHUNK_PACKETS)
+            continue;
+
+        if (n > 1 && (packets*DRAGON_PACKET_SIZE_BYTES) % PAGE_SIZE)
+            continue;
+
+        *chunks = n;
+        *chunk_size = packets*DRAGON_PACKET_SIZE_BYTES;
+        return 0;
+    }
+
+    return -EINVAL;
+}
+
 static int dragon_check_params(dragon_params* params)
 {
+    uint32_t chunks, chunk_size;
+
     if (!params)
         return -EINVAL;
 
@@ -117,12 +366,19 @@ static int dragon_check_params(dragon_params* params)
     }
 
     if (!params->frames_per_buffer ||
-        params->frames_per_buffer*params->frame_length > DRAGON_MAX_FRAMES_PER_BUFFER*DRAGON_DATA_PER_PACKET)
+        (uint64_t)params->frames_per_buffer*params->frame_length >
+            (uint64_t)DRAGON_MAX_FRAMES_PER_BUFFER*DRAGON_DATA_PER_PACKET*DRAGON_MAX_CHUNKS_PER_BUFFER)
     {
         printk(KERN_INFO "Bad dragon frames_per_buffer value\n");
         return -EINVAL;
     }
 
+    if (dragon_buffer_layout(params, &chunks, &chunk_size))
+    {
+        printk(KERN_INFO "dragon frames_per_buffer can't be split into page sized chunks\n");
+        return -EINVAL;
+    }
+
     /*
     if (1 <= params->switch_period && params->switch_period <= (1 << 24))
     {
@@ -162,20 +418,251 @@ static int dragon_check_params(dragon_params* params)
     return 0;
 }
 
+static irqreturn_t dragon_irq_handler(int irq, void *data);
+static irqreturn_t dragon_irq_thread(int irq, void *data);
+static void dragon_finish_reconfig(struct dragon_private *private, int apply);
+static void dragon_uring_kick(struct dragon_private *private);
+
+static ktime_t dragon_emu_period(dragon_emu *emu)
+{
+    uint64_t ticks = (uint64_t)(emu->regs[6] + 1)*DRAGON_DATA_PER_PACKET;
+    uint32_t rate = dragon_emu_sample_rate ? dragon_emu_sample_rate : 1;
+
+    return ns_to_ktime(div_u64(ticks*NSEC_PER_SEC, rate));
+}
+
+static void dragon_emu_fill_buffer(dragon_emu *emu, uint8_t *va)
+{
+    uint32_t packets = emu->regs[6] + 1;
+    uint32_t frame_packets = (emu->regs[7] + 1)*8/DRAGON_DATA_PER_PACKET;
+    int channel_auto = (emu->regs[4] >> 8) & 1;
+    uint32_t channel = (emu->regs[4] >> 7) & 1;
+    uint32_t i, pos;
+
+    if (!frame_packets)
+        frame_packets = 1;
+
+    for (i = 0; i < packets; i += frame_packets)
+    {
+        if (channel_auto)
+            channel = emu->frame_counter & 1;
+
+        for (pos = 0; pos < frame_packets && i + pos < packets; pos++)
+        {
+            uint32_t *header = (uint32_t*)va;
+
+            header[0] = emu->frame_counter;
+            header[1] = (pos*DRAGON_DATA_PER_PACKET) | (channel << 31);
+            // decaying staircase, one step per packet, offset per channel
+            memset(va + DRAGON_PACKET_HEADER_BYTES,
+                   (uint8_t)(0xF0 - (channel << 6) - (pos & 0x3F)),
+                   DRAGON_DATA_PER_PACKET);
+            va += DRAGON_PACKET_SIZE_BYTES;
+        }
+
+        emu->frame_counter++;
+    }
+}
+
+static enum hrtimer_restart dragon_emu_timer(struct hrtimer *timer)
+{
+    dragon_emu *emu = container_of(timer, dragon_emu, timer);
+    unsigned long flags;
+    uint32_t addr;
+    int restart;
+
+    spin_lock_irqsave(&emu->lock, flags);
+    if (!emu->running || !emu->fifo_count)
+    {
+        emu->armed = 0;
+        spin_unlock_irqrestore(&emu->lock, flags);
+        return HRTIMER_NORESTART;
+    }
+    addr = emu->fifo[emu->fifo_head];
+    emu->fifo_head = (emu->fifo_head + 1) % DRAGON_MAX_BUFFER_COUNT;
+    emu->fifo_count--;
+    emu->done[(emu->done_head + emu->done_count) % DRAGON_MAX_BUFFER_COUNT] = addr;
+    emu->done_count++;
+
+    restart = emu->running && emu->fifo_count;
+    if (restart)
+        hrtimer_forward_now(timer, dragon_emu_period(emu));
+    else
+        emu->armed = 0;
+    spin_unlock_irqrestore(&emu->lock, flags);
+
+    // filling a buffer is too long for hard IRQ context
+    queue_work(system_highpri_wq, &emu->irq_work);
+
+    return restart ? HRTIMER_RESTART : HRTIMER_NORESTART;
+}
+
+// Fill the transferred buffers, then complete them like the board would:
+// update reg 2, raise an "MSI" per buffer and run the completion thread
+static void dragon_emu_irq_work(struct work_struct *work)
+{
+    dragon_emu *emu = container_of(work, dragon_emu, irq_work);
+    unsigned long flags;
+    uint32_t addr;
+    int raised = 0;
+
+    for (;;)
+    {
+        spin_lock_irqsave(&emu->lock, flags);
+        if (!emu->done_count)
+        {
+            spin_unlock_irqrestore(&emu->lock, flags);
+            break;
+        }
+        addr = emu->done[emu->done_head];
+        emu->done_head = (emu->done_head + 1) % DRAGON_MAX_BUFFER_COUNT;
+        emu->done_count--;
+        spin_unlock_irqrestore(&emu->lock, flags);
+
+        // emulated DMA addresses are physical addresses of lowmem pages
+        if (dragon_emu_fill)
+            dragon_emu_fill_buffer(emu, phys_to_virt(addr));
+
+        spin_lock_irqsave(&emu->lock, flags);
+        emu->last_done = addr;
+        spin_unlock_irqrestore(&emu->lock, flags);
+
+        if (dragon_irq_handler(0, emu->private) == IRQ_WAKE_THREAD)
+            raised = 1;
+    }
+
+    if (raised)
+        dragon_irq_thread(0, emu->private);
+}
+
+static void dragon_emu_arm(dragon_emu *emu)
+{
+    if (emu->running && emu->fifo_count && !emu->armed)
+    {
+        emu->armed = 1;
+        hrtimer_start(&emu->timer, dragon_emu_period(emu), HRTIMER_MODE_REL);
+    }
+}
+
+static void dragon_emu_write_reg(dragon_emu *emu,
+                                 uint32_t dw_offset, uint32_t val)
+{
+    unsigned long flags;
+
+    if (dw_offset >= DRAGON_EMU_REG_COUNT)
+        return;
+
+    // stop and reset must not race with a completion in flight
+    if ((dw_offset == 0 && val) || (dw_offset == 1 && !val))
+    {
+        spin_lock_irqsave(&emu->lock, flags);
+        emu->running = 0;
+        spin_unlock_irqrestore(&emu->lock, flags);
+        hrtimer_cancel(&emu->timer);
+    }
+
+    spin_lock_irqsave(&emu->lock, flags);
+    emu->regs[dw_offset] = val;
+    switch (dw_offset)
+    {
+    case 0:
+        if (val)
+        {
+            emu->fifo_head = 0;
+            emu->fifo_count = 0;
+            emu->done_head = 0;
+            emu->done_count = 0;
+            emu->last_done = 0;
+            emu->frame_counter = 0;
+            emu->armed = 0;
+        }
+        break;
+
+    case 1:
+        emu->running = val & 1;
+        if (!emu->running)
+            emu->armed = 0;
+        dragon_emu_arm(emu);
+        break;
+
+    case 2:
+        if (emu->fifo_count < DRAGON_MAX_BUFFER_COUNT)
+        {
+            emu->fifo[(emu->fifo_head + emu->fifo_count) % DRAGON_MAX_BUFFER_COUNT] = val;
+            emu->fifo_count++;
+        }
+        dragon_emu_arm(emu);
+        break;
+    }
+    spin_unlock_irqrestore(&emu->lock, flags);
+}
+
+static uint32_t dragon_emu_read_reg(dragon_emu *emu, uint32_t dw_offset)
+{
+    unsigned long flags;
+    uint32_t val = 0;
+
+    spin_lock_irqsave(&emu->lock, flags);
+    if (dw_offset == 2)
+        val = emu->last_done;
+    else if (dw_offset == 8)
+        val = DRAGON_EMU_ID;
+    else if (dw_offset < DRAGON_EMU_REG_COUNT)
+        val = emu->regs[dw_offset];
+    spin_unlock_irqrestore(&emu->lock, flags);
+
+    return val;
+}
+
 static inline void dragon_write_reg32(dragon_private* private,
                                       uint32_t dw_offset, uint32_t val)
 {
+    if (unlikely(private->emu))
+    {
+        dragon_emu_write_reg(private->emu, dw_offset, val);
+        return;
+    }
+
     iowrite32(val, private->io_buffer + ((dw_offset) << 2));
-    mmiowb();
 }
 
 static inline uint32_t dragon_read_reg32(dragon_private* private,
                                       uint32_t dw_offset)
 {
+    if (unlikely(private->emu))
+        return dragon_emu_read_reg(private->emu, dw_offset);
+
     return ioread32(private->io_buffer + ((dw_offset) << 2));
 }
 
-static long dragon_write_params(dragon_private* private,
+// Fit allocated buffers to the current params. Buffers are reused while the
+// chunk count and allocation order stay the same (pool chunks fit anything
+// up to their order), only the synced and reported sizes follow the
+// payload; returns nonzero if they don't fit.
+static int dragon_resize_buffers(dragon_private* private)
+{
+    size_t i;
+
+    // multi-chunk buffers are mapped at chunk size steps
+    if (private->buf_chunks != private->chunks ||
+        (private->buf_chunks > 1 && private->buf_chunk_size != private->chunk_size) ||
+        (private->buf_pooled ? get_order(private->chunk_size) > private->buf_order :
+                               get_order(private->chunk_size) != private->buf_order))
+    {
+        return -1;
+    }
+
+    private->buf_chunk_size = private->chunk_size;
+    for (i = 0; i < private->buf_count; i++)
+    {
+        private->buffers[i].buf.len = private->buf_chunks*private->buf_chunk_size;
+    }
+
+    return 0;
+}
+
+// Write changed params to the device; NULL writes all of them
+static void dragon_apply_params(dragon_private* private,
                                 dragon_params* params)
 {
 #ifdef VAL_CHANGED
@@ -189,25 +676,27 @@ static long dragon_write_params(dragon_private* private,
 #endif
 #define VAL(name) private->params.name
 
-    long err = 0;
-
-    spin_lock(&private->activity_lock);
-    if (private->activity)
-    {
-        printk(KERN_INFO "Couldn't set params while in active mode\n");
-        err = -EAGAIN;
-        goto unlock;
-    }
+    int frame_length_changed = 0;
 
     if (VAL_CHANGED(frame_length))
     {
         dragon_write_reg32(private, 7, VAL(frame_length)/8 - 1);
+        frame_length_changed = 1;
     }
 
-    if (VAL_CHANGED(frames_per_buffer))
+    // reg 6 holds the size of one device transfer in packets
+    if (VAL_CHANGED(frames_per_buffer) | frame_length_changed)
     {
+        dragon_buffer_layout(&private->params, &private->chunks, &private->chunk_size);
         dragon_write_reg32(private, 6,
-                           VAL(frames_per_buffer)*VAL(frame_length)/DRAGON_DATA_PER_PACKET - 1);
+                           private->chunk_size/DRAGON_PACKET_SIZE_BYTES - 1);
+
+        // keep buffers of the same size class usable without REQUEST_BUFFERS;
+        // while active, buffers pick up their new length as they complete
+        if (private->buffers && !private->activity)
+            dragon_resize_buffers(private);
+        else if (private->buffers)
+            private->buf_chunk_size = private->chunk_size;
     }
 
     /*
@@ -250,29 +739,65 @@ static long dragon_write_params(dragon_private* private,
         dragon_write_reg32(private, 3, VAL(dac_data));
     }
 
+#undef  VAL
+#undef  VAL_CHANGED
+}
+
+static long dragon_write_params(dragon_private* private,
+                                dragon_params* params)
+{
+    long err = 0;
+
+    mutex_lock(&private->activity_lock);
+    if (private->activity)
+    {
+        printk(KERN_INFO "Couldn't set params while in active mode\n");
+        err = -EAGAIN;
+        goto unlock;
+    }
+
+    dragon_apply_params(private, params);
+
 unlock:
-    spin_unlock(&private->activity_lock);
+    mutex_unlock(&private->activity_lock);
     return err;
+}
 
-
-#undef  VAL
-#undef  VAL_CHANGED
+// Pulse the FPGA reset; emulated boards reset synchronously
+static void dragon_reset_device(dragon_private *private)
+{
+    dragon_write_reg32(private, 1, 0); // disable DMA writing
+    dragon_write_reg32(private, 0, 1); // assert reset signal in FPGA: stop FIFOs, reset counters
+    if (!private->emu)
+        msleep(DRAGON_RESET_MS);
+    dragon_write_reg32(private, 0, 0); // deassert reset
 }
 
 static long dragon_set_activity(dragon_private *private, int arg)
 {
+    unsigned long irq_flags;
+
+    trace_dragon_set_activity(MINOR(private->cdev_no), arg,
+                              atomic_read(&private->queue_length));
+
     if (arg)
     {
         dragon_write_reg32(private, 1, 1); // start DMA writing
-        spin_lock(&private->activity_lock);
+        mutex_lock(&private->activity_lock);
+        if (!private->activity)
+        {
+            private->sequence = 0;
+        }
         private->activity = 1;
-        spin_unlock(&private->activity_lock);
+        mutex_unlock(&private->activity_lock);
     }
     else
     {
-        spin_lock(&private->activity_lock);
+        mutex_lock(&private->activity_lock);
         private->activity = 0;
-        spin_unlock(&private->activity_lock);
+        mutex_unlock(&private->activity_lock);
+        wake_up_interruptible(&private->wait); // release blocked DQBUFs
+        dragon_uring_kick(private);
 
         //Wait for completeness
         while (atomic_read(&private->queue_length) > 0)
@@ -285,15 +810,116 @@ static long dragon_set_activity(dragon_private *private, int arg)
             finish_wait(&private->wait, &wait_for_completeness);
         }
 
-        dragon_write_reg32(private, 1, 0); // disable DMA writing
-        dragon_write_reg32(private, 0, 1); // assert reset signal in FPGA: stop FIFOs, reset counters
-        msleep(100);
-        dragon_write_reg32(private, 0, 0); // deassert reset
+        // a reconfiguration still pending applies to the idle device
+        spin_lock_irqsave(&private->submit_lock, irq_flags);
+        if (private->reconfig_pending)
+        {
+            dragon_finish_reconfig(private, 1);
+        }
+        spin_unlock_irqrestore(&private->submit_lock, irq_flags);
+
+        dragon_reset_device(private);
+        private->head_chunk = 0;
     }
 
     return 0;
 }
 
+// Emulated devices have no bus: their "DMA address" is the physical one
+static dma_addr_t dragon_map_single(dragon_private* private,
+                                    void* va, size_t size)
+{
+    dma_addr_t dma_handle;
+
+    if (private->emu)
+        return virt_to_phys(va);
+
+    dma_handle = dma_map_single(&private->pci_dev->dev, va, size, DMA_FROM_DEVICE);
+
+    return dma_mapping_error(&private->pci_dev->dev, dma_handle) ? 0 : dma_handle;
+}
+
+static void dragon_unmap_single(dragon_private* private,
+                                dma_addr_t dma_handle, size_t size)
+{
+    if (!private->emu)
+        dma_unmap_single(&private->pci_dev->dev, dma_handle, size, DMA_FROM_DEVICE);
+}
+
+static void dragon_sync_for_cpu(dragon_private* private,
+                                dma_addr_t dma_handle, size_t size)
+{
+    uint64_t start, duration;
+
+    if (private->emu)
+        return;
+
+    start = ktime_get_ns();
+    dma_sync_single_for_cpu(&private->pci_dev->dev, dma_handle, size,
+                            DMA_FROM_DEVICE);
+    duration = ktime_get_ns() - start;
+    atomic64_add(duration, &private->stats.sync_cpu_ns);
+    atomic64_inc(&private->stats.sync_cpu_count);
+    trace_dragon_sync_for_cpu(MINOR(private->cdev_no), dma_handle, size, duration);
+}
+
+static void dragon_sync_for_device(dragon_private* private,
+                                   dma_addr_t dma_handle, size_t size)
+{
+    uint64_t start;
+
+    if (private->emu)
+        return;
+
+    start = ktime_get_ns();
+    dma_sync_single_for_device(&private->pci_dev->dev, dma_handle, size,
+                               DMA_FROM_DEVICE);
+    trace_dragon_sync_for_device(MINOR(private->cdev_no), dma_handle, size,
+                                 ktime_get_ns() - start);
+}
+
+static void dragon_sync_buffer_for_cpu(dragon_private* private,
+                                       dragon_buffer_opaque *opaque)
+{
+    uint32_t c;
+
+    if (private->buf_coherent)
+        return;
+
+    for (c = 0; c < private->buf_chunks; c++)
+    {
+        // buffer length is the one it was filled with
+        dragon_sync_for_cpu(private, opaque->chunks[c].dma_handle,
+                            opaque->buf.len/private->buf_chunks);
+    }
+}
+
+static void dragon_sync_buffer_for_device(dragon_private* private,
+                                          dragon_buffer_opaque *opaque)
+{
+    uint32_t c;
+
+    if (private->buf_coherent)
+        return;
+
+    for (c = 0; c < private->buf_chunks; c++)
+    {
+        dragon_sync_for_device(private, opaque->chunks[c].dma_handle,
+                               private->buf_chunk_size);
+    }
+}
+
+// Give the buffer to the device unless it already is; done before
+// submit_lock is taken, as syncing a big buffer takes a while
+static void dragon_prepare_buffer(dragon_private* private,
+                                  dragon_buffer_opaque *opaque)
+{
+    if (atomic_cmpxchg(&opaque->owned_by_cpu, 1, 0))
+    {
+        dragon_sync_buffer_for_device(private, opaque);
+    }
+}
+
 static void dragon_lock_pages(dragon_private* private,
                               void* va, size_t size)
 {
@@ -323,69 +949,251 @@ static void dragon_unlock_pages(dragon_private* private,
 
 }
 
-static long dragon_release_buffers(dragon_private* private)
+static void dragon_free_chunk(dragon_private* private, dragon_chunk *chunk)
 {
-    int i;
-    long err = 0;
-
-    spin_lock(&private->activity_lock);
-    if (private->activity)
+    // pool chunks stay mapped, dragon_free_buffers() rewinds the pool
+    if (private->buf_pooled)
     {
-        printk(KERN_INFO "Couldn't release buffers while in active mode\n");
-        err = -EAGAIN;
-        goto unlock;
+        private->pool_next--;
+        return;
     }
 
-    if (private->buffers)
+    if (private->buf_coherent && private->pci_dev)
     {
-        for (i = 0; i < private->buf_count; i++)
-       {
-            pci_unmap_single(private->pci_dev, private->buffers[i].dma_handle,
-                             private->buffers[i].buf.len, PCI_DMA_FROMDEVICE);
-
-            //Unlock memory pages
-            dragon_unlock_pages(private,
-                                private->buffers[i].buf.ptr,
-                                private->buffers[i].buf.len);
+        dma_free_coherent(&private->pci_dev->dev, private->buf_chunk_alloc,
+                          chunk->ptr, chunk->dma_handle);
+        return;
+    }
 
-            free_pages((unsigned long)private->buffers[i].buf.ptr,
-                       DRAGON_BUFFER_ORDER);
-        }
+    dragon_unmap_single(private, chunk->dma_handle, private->buf_chunk_alloc);
 
-        vfree(private->buffers);
+    //Unlock memory pages
+    dragon_unlock_pages(private, chunk->ptr, private->buf_chunk_alloc);
 
-        private->buffers = 0;
-        private->buf_count = 0;
-    }
+    free_pages((unsigned long)chunk->ptr, private->buf_order);
+}
 
-    private->qlist_head = 0;
-    private->dqlist_head = 0;
+// Compound, so pipe readers may take references on any of the pages
+// The board takes 32-bit addresses, and ZONE_DMA32 usually exists on one
+// node only, so other nodes can only be served by falling back to it
+static void* dragon_alloc_pages(int node, unsigned int order, int strict)
+{
+    struct page *pg = alloc_pages_node(node, GFP_DMA32 | __GFP_COMP |
+                                       (strict ? __GFP_THISNODE : 0), order);
 
-unlock:
-    spin_unlock(&private->activity_lock);
-    return err;
+    return pg ? page_address(pg) : 0;
 }
 
-static long dragon_request_buffers(dragon_private* private, size_t *count)
+static int dragon_chunk_node(dragon_chunk *chunk)
 {
-    size_t i, idx = 0;
-    long err = 0;
-    dragon_buffer_opaque *buffers;
-    size_t buffer_size =
-        (private->params.frame_length/DRAGON_DATA_PER_PACKET)*DRAGON_PACKET_SIZE_BYTES*
-         private->params.frames_per_buffer;
+    return virt_addr_valid(chunk->ptr) ?
+        page_to_nid(virt_to_page(chunk->ptr)) : NUMA_NO_NODE;
+}
 
-    spin_lock(&private->activity_lock);
-    if (private->activity)
+static int dragon_alloc_chunk(dragon_private* private, dragon_chunk *chunk)
+{
+    if (private->buf_pooled)
     {
-        printk(KERN_INFO "Couldn't request buffers while in active mode\n");
-        err = -EAGAIN;
-        goto unlock;
+        if (private->pool_next >= private->pool_count)
+            return -ENOMEM;
+
+        *chunk = private->pool[private->pool_next++];
+        return 0;
     }
 
-    if (!buffer_size)
+    // emulated devices need no syncs anyway, they keep using plain pages
+    if (private->buf_coherent && private->pci_dev)
     {
-        printk(KERN_INFO "Zero buffer size\n");
+        chunk->ptr = dma_alloc_coherent(&private->pci_dev->dev,
+                                        private->buf_chunk_alloc,
+                                        &chunk->dma_handle, GFP_KERNEL);
+        if (!chunk->ptr)
+            return -ENOMEM;
+
+        // coherent memory goes where the DMA API puts it
+        if (private->buf_strict_node && dragon_chunk_node(chunk) != private->buf_node)
+        {
+            dragon_free_chunk(private, chunk);
+            return -ENOMEM;
+        }
+        return 0;
+    }
+
+    if ( !(chunk->ptr = dragon_alloc_pages(private->buf_node, private->buf_order,
+                                           private->buf_strict_node)) )
+    {
+        return -ENOMEM;
+    }
+
+    if (!(chunk->dma_handle = dragon_map_single(private,
+                                                chunk->ptr,
+                                                private->buf_chunk_alloc)))
+    {
+        free_pages((unsigned long)chunk->ptr, private->buf_order);
+        return -ENOMEM;
+    }
+
+    //Lock memory pages
+    dragon_lock_pages(private, chunk->ptr, private->buf_chunk_alloc);
+
+    return 0;
+}
+
+// Free all buffers; called with activity_lock held while inactive
+static void dragon_free_buffers(dragon_private* private)
+{
+    size_t i;
+    uint32_t c;
+
+    mutex_lock(&private->map_lock);
+    if (private->buffers)
+    {
+        // later accesses fault and get SIGBUS instead of reaching freed pages
+        if (private->mapping)
+            unmap_mapping_range(private->mapping, 0, DRAGON_RING_MMAP_OFFSET, 1);
+
+        for (i = 0; i < private->buf_count; i++)
+        {
+            for (c = 0; c < private->buf_chunks; c++)
+            {
+                dragon_free_chunk(private, &private->buffers[i].chunks[c]);
+            }
+        }
+
+        vfree(private->buffers);
+
+        private->buffers = 0;
+        private->buf_count = 0;
+    }
+    mutex_unlock(&private->map_lock);
+
+    dragon_index_ring_reset(&private->qring);
+    dragon_index_ring_reset(&private->dqring);
+    dragon_index_ring_reset(&private->hold);
+    private->head_chunk = 0;
+    private->pool_next = 0;
+    private->read_buf = 0;
+    atomic_set(&private->stream_buffers, 0);
+}
+
+// Reserve and map pool_chunks chunks for the device lifetime, so that
+// sessions don't depend on finding high-order free pages; a partial pool
+// is kept if memory runs out
+static void dragon_pool_create(dragon_private* private)
+{
+    size_t size, i;
+    void *ptr;
+    dma_addr_t dma_handle;
+
+    if (!dragon_pool_chunks)
+        return;
+
+    private->pool_order = min(dragon_pool_order, (unsigned int)DRAGON_BUFFER_ORDER);
+    size = PAGE_SIZE << private->pool_order;
+
+    private->pool = vmalloc(min(dragon_pool_chunks, (unsigned int)DRAGON_MAX_BUFFER_COUNT)*
+                            sizeof(dragon_chunk));
+    if (!private->pool)
+        return;
+
+    for (i = 0; i < min(dragon_pool_chunks, (unsigned int)DRAGON_MAX_BUFFER_COUNT); i++)
+    {
+        if ( !(ptr = dragon_alloc_pages(private->dev_node, private->pool_order, 0)) )
+            break;
+
+        if ( !(dma_handle = dragon_map_single(private, ptr, size)) )
+        {
+            free_pages((unsigned long)ptr, private->pool_order);
+            break;
+        }
+
+        dragon_lock_pages(private, ptr, size);
+        private->pool[i].ptr = ptr;
+        private->pool[i].dma_handle = dma_handle;
+    }
+    private->pool_count = i;
+
+    printk(KERN_INFO "dragon device %d: reserved %zu of %u pool chunks\n",
+           MINOR(private->cdev_no), private->pool_count, dragon_pool_chunks);
+}
+
+static void dragon_pool_destroy(dragon_private* private)
+{
+    size_t size = PAGE_SIZE << private->pool_order;
+    size_t i;
+
+    for (i = 0; i < private->pool_count; i++)
+    {
+        dragon_unmap_single(private, private->pool[i].dma_handle, size);
+        dragon_unlock_pages(private, private->pool[i].ptr, size);
+        free_pages((unsigned long)private->pool[i].ptr, private->pool_order);
+    }
+
+    vfree(private->pool);
+    private->pool = 0;
+    private->pool_count = 0;
+}
+
+// Pages lent to a pipe must outlive it; only the buffer being read may go
+static int dragon_buffers_busy(dragon_private* private)
+{
+    return atomic_read(&private->stream_buffers) > !!private->read_buf;
+}
+
+static long dragon_release_buffers(dragon_private* private)
+{
+    long err = 0;
+
+    mutex_lock(&private->activity_lock);
+    if (private->activity)
+    {
+        printk(KERN_INFO "Couldn't release buffers while in active mode\n");
+        err = -EAGAIN;
+        goto unlock;
+    }
+
+    if (dragon_buffers_busy(private))
+    {
+        printk(KERN_INFO "Couldn't release buffers still spliced to a pipe\n");
+        err = -EBUSY;
+        goto unlock;
+    }
+
+    dragon_free_buffers(private);
+
+unlock:
+    mutex_unlock(&private->activity_lock);
+    return err;
+}
+
+// node is NUMA_NO_NODE for the device's own node
+static long dragon_request_buffers(dragon_private* private, size_t *count,
+                                   uint32_t flags, int node)
+{
+    size_t i, idx = 0;
+    uint32_t c;
+    int strict;
+    long err = 0;
+    dragon_buffer_opaque *buffers;
+
+    mutex_lock(&private->activity_lock);
+    if (private->activity)
+    {
+        printk(KERN_INFO "Couldn't request buffers while in active mode\n");
+        err = -EAGAIN;
+        goto unlock;
+    }
+
+    if (dragon_buffers_busy(private))
+    {
+        printk(KERN_INFO "Couldn't request buffers while spliced to a pipe\n");
+        err = -EBUSY;
+        goto unlock;
+    }
+
+    if (!private->chunk_size)
+    {
+        printk(KERN_INFO "Zero buffer size\n");
         err = -EINVAL;
         goto unlock;
     }
@@ -398,13 +1206,39 @@ static long dragon_request_buffers(dragon_private* private, size_t *count)
         goto unlock;
     }
 
-    if(get_order(buffer_size) > DRAGON_BUFFER_ORDER)
+    // every chunk takes a slot in the device address FIFO
+    if (*count*private->chunks > DRAGON_MAX_BUFFER_COUNT)
+    {
+        *count = DRAGON_MAX_BUFFER_COUNT/private->chunks;
+    }
+
+    if(get_order(private->chunk_size) > DRAGON_BUFFER_ORDER)
     {
         printk(KERN_INFO "dragon buffer size is too big\n");
         err = -EINVAL;
         goto unlock;
     }
 
+    strict = node != NUMA_NO_NODE;
+    if (!strict)
+    {
+        node = private->dev_node;
+    }
+    else if (node < 0 || node >= MAX_NUMNODES || !node_online(node))
+    {
+        printk(KERN_INFO "Bad dragon buffer node %d\n", node);
+        err = -EINVAL;
+        goto unlock;
+    }
+
+    // buffers of a different size class, memory type or node can't be reused
+    if (private->buffers &&
+        (dragon_resize_buffers(private) ||
+         private->buf_coherent != !!(flags & DRAGON_REQUEST_COHERENT) ||
+         private->buf_node != node || private->buf_strict_node != strict))
+    {
+        dragon_free_buffers(private);
+    }
 
     if (private->buf_count >= *count)
     {
@@ -422,48 +1256,61 @@ static long dragon_request_buffers(dragon_private* private, size_t *count)
     }
     memset(buffers, 0, *count*sizeof(dragon_buffer_opaque));
 
+    mutex_lock(&private->map_lock);
     if (private->buffers)
     {
         memcpy(buffers, private->buffers,
-               private->buf_count*sizeof(dragon_buffer));
+               private->buf_count*sizeof(dragon_buffer_opaque));
         vfree(private->buffers);
         private->buffers = 0;
         idx = private->buf_count;
     }
 
+    private->buf_chunks = private->chunks;
+    private->buf_chunk_size = private->chunk_size;
+    private->buf_coherent = !!(flags & DRAGON_REQUEST_COHERENT);
+    private->buf_node = node;
+    private->buf_strict_node = strict;
+    // the pool is only near the board, not necessarily on its node
+    private->buf_pooled = private->pool_count && !private->buf_coherent &&
+        !strict &&
+        get_order(private->chunk_size) <= private->pool_order;
+    private->buf_order = private->buf_pooled ?
+        private->pool_order : get_order(private->chunk_size);
+    private->buf_chunk_alloc = PAGE_SIZE << private->buf_order;
+    private->buf_map_size = private->buf_chunks == 1 ?
+        private->buf_chunk_alloc : private->buf_chunks*private->buf_chunk_size;
+
     for (i = idx; i < *count; i++)
     {
-        if ( !(buffers[i].buf.ptr = (void*)
-               __get_free_pages(GFP_DMA32, DRAGON_BUFFER_ORDER)) )
+        for (c = 0; c < private->buf_chunks; c++)
         {
-            break;
+            if (dragon_alloc_chunk(private, &buffers[i].chunks[c]))
+                break;
         }
-        buffers[i].buf.len = (1 << DRAGON_BUFFER_ORDER) << PAGE_SHIFT;
 
-        if (!(buffers[i].dma_handle = pci_map_single(private->pci_dev,
-                                                     buffers[i].buf.ptr,
-                                                     buffers[i].buf.len,
-                                                     PCI_DMA_FROMDEVICE)))
+        if (c < private->buf_chunks)
         {
-            free_pages((unsigned long)buffers[i].buf.ptr, DRAGON_BUFFER_ORDER);
+            while (c--)
+                dragon_free_chunk(private, &buffers[i].chunks[c]);
             break;
         }
 
-        buffers[i].buf.offset = buffers[i].dma_handle;
+        // a multi-chunk buffer is presented as its chunks' payloads back to back
+        buffers[i].buf.ptr = buffers[i].chunks[0].ptr;
+        buffers[i].buf.len = private->buf_chunks*private->buf_chunk_size;
+        // stable mmap() offset, the same for every open
+        buffers[i].buf.offset = i*private->buf_map_size;
         buffers[i].buf.idx = i;
-        atomic_set(&buffers[i].owned_by_cpu, 0);
-
-        INIT_LIST_HEAD(&buffers[i].qlist);
-        INIT_LIST_HEAD(&buffers[i].dqlist);
-
-        //Lock memory pages
-        dragon_lock_pages(private,
-                          buffers[i].buf.ptr,
-                          buffers[i].buf.len);
+        buffers[i].private = private;
+        // a previous session may have left pool chunks synced for the CPU
+        atomic_set(&buffers[i].owned_by_cpu, private->buf_pooled);
+        atomic_set(&buffers[i].queued, 0);
     }
 
     if (!i)
     {
+        mutex_unlock(&private->map_lock);
         vfree(buffers);
         printk(KERN_INFO "dragon couldn't allocate or map buffer\n");
         err = -ENOMEM;
@@ -473,8 +1320,19 @@ static long dragon_request_buffers(dragon_private* private, size_t *count)
     private->buffers = buffers;
     private->buf_count = *count = i;
 
+    private->buf_mem_node = dragon_chunk_node(&buffers[0].chunks[0]);
+    for (i = 0; i < private->buf_count; i++)
+    {
+        for (c = 0; c < private->buf_chunks; c++)
+        {
+            if (dragon_chunk_node(&buffers[i].chunks[c]) != private->buf_mem_node)
+                private->buf_mem_node = NUMA_NO_NODE;
+        }
+    }
+    mutex_unlock(&private->map_lock);
+
 unlock:
-    spin_unlock(&private->activity_lock);
+    mutex_unlock(&private->activity_lock);
     return err;
 }
 
@@ -490,17 +1348,78 @@ static long dragon_query_buffer(dragon_private *private, dragon_buffer *buffer)
     return 0;
 }
 
-static long dragon_qbuf(dragon_private *private, dragon_buffer *buffer)
+// Take a buffer over from userspace; fails if the driver holds it already,
+// i.e. it's queued twice or requeued without being dequeued
+static int dragon_claim_buffer(dragon_buffer_opaque *opaque)
+{
+    return atomic_xchg(&opaque->queued, 1) ? -EBUSY : 0;
+}
+
+static void dragon_unclaim_buffers(dragon_private *private,
+                                   dragon_buffer *buffers, size_t count)
+{
+    while (count--)
+    {
+        atomic_set(&private->buffers[buffers[count].idx].queued, 0);
+    }
+}
+
+// Append buffer to qring and hand it to the device; called with submit_lock
+// held so that qring order always matches the device FIFO order, after
+// dragon_prepare_buffer()
+static int dragon_submit_buffer(dragon_private *private,
+                                dragon_buffer_opaque *opaque)
+{
+    uint32_t queued, c;
+
+    // held back until the pending reconfiguration is applied
+    if (private->reconfig_pending)
+    {
+        return dragon_index_ring_push(&private->hold, opaque->buf.idx);
+    }
+
+    opaque->buf.queued_ns = ktime_get_ns();
+    opaque->buf.flags = 0;
+    if (!atomic_read(&private->queue_length) && private->sequence)
+    {
+        opaque->buf.flags |= DRAGON_BUFFER_UNDERRUN;
+    }
+
+    if (dragon_index_ring_push(&private->qring, opaque->buf.idx))
+    {
+        return -ENOSPC;
+    }
+
+    queued = atomic_add_return(private->buf_chunks, &private->queue_length);
+    if (queued > private->stats.peak_queue_length)
+    {
+        private->stats.peak_queue_length = queued;
+    }
+    // sequence the buffer is expected to complete with
+    trace_dragon_qbuf(MINOR(private->cdev_no), opaque->buf.idx,
+                      opaque->chunks[0].dma_handle, queued,
+                      private->sequence + dragon_index_ring_count(&private->qring) - 1);
+
+    for (c = 0; c < private->buf_chunks; c++)
+    {
+        dragon_write_reg32(private, 2, opaque->chunks[c].dma_handle);
+    }
+
+    return 0;
+}
+
+// Queue count buffers to the device under a single acquisition of the locks;
+// either all of them are queued or none
+static long dragon_queue_buffers(dragon_private *private,
+                                 dragon_buffer *buffers, size_t count)
 {
     unsigned long irq_flags;
-    dragon_buffer_opaque *opaque;
+    dragon_index_ring *ring;
     uint32_t addr_read;
+    size_t i;
     long err = 0;
-    size_t buffer_size =
-        (private->params.frame_length/DRAGON_DATA_PER_PACKET)*DRAGON_PACKET_SIZE_BYTES*
-        private->params.frames_per_buffer;
 
-    spin_lock(&private->activity_lock);
+    mutex_lock(&private->activity_lock);
     if (!private->activity)
     {
         printk(KERN_INFO "Couldn't queue buffer while in non-active mode\n");
@@ -508,214 +1427,1321 @@ static long dragon_qbuf(dragon_private *private, dragon_buffer *buffer)
         goto unlock;
     }
 
-    if (!buffer || buffer->idx >= private->buf_count)
+    // buffers must have been allocated for the current params
+    if (private->buf_chunks != private->chunks ||
+        private->buf_chunk_size != private->chunk_size)
     {
-        err = -EINVAL;
+        printk(KERN_INFO "Couldn't queue buffer of different size\n");
+        err = -EAGAIN;
         goto unlock;
     }
 
-    opaque = &private->buffers[buffer->idx];
+    for (i = 0; i < count; i++)
+    {
+        if (buffers[i].idx >= private->buf_count)
+        {
+            err = -EINVAL;
+            goto unlock;
+        }
+    }
 
-    if (opaque->buf.len < buffer_size)
+    for (i = 0; i < count; i++)
     {
-        printk(KERN_INFO "Couldn't queue small size buffer\n");
-        err = -EAGAIN;
-        goto unlock;
+        if (dragon_claim_buffer(&private->buffers[buffers[i].idx]))
+        {
+            dragon_unclaim_buffers(private, buffers, i);
+            printk(KERN_INFO "Couldn't queue buffer %zu twice\n", buffers[i].idx);
+            err = -EBUSY;
+            goto unlock;
+        }
     }
 
-    spin_lock_irqsave(&private->lists_lock, irq_flags);
+    for (i = 0; i < count; i++)
+    {
+        dragon_prepare_buffer(private, &private->buffers[buffers[i].idx]);
+    }
 
-    if (private->qlist_head)
+    spin_lock_irqsave(&private->submit_lock, irq_flags);
+    // buffers are held back while a reconfiguration is pending
+    ring = private->reconfig_pending ? &private->hold : &private->qring;
+    if (count > DRAGON_MAX_BUFFER_COUNT - dragon_index_ring_count(ring))
     {
-        list_add_tail(&opaque->qlist, private->qlist_head);
+        spin_unlock_irqrestore(&private->submit_lock, irq_flags);
+        dragon_unclaim_buffers(private, buffers, count);
+        printk(KERN_INFO "Buffers queue is full\n");
+        err = -EINVAL;
+        goto unlock;
     }
-    else
+    for (i = 0; i < count; i++)
     {
-        private->qlist_head = &opaque->qlist;
+        err = dragon_submit_buffer(private, &private->buffers[buffers[i].idx]);
+        if (err)
+            break;
     }
+    spin_unlock_irqrestore(&private->submit_lock, irq_flags);
 
-    spin_unlock_irqrestore(&private->lists_lock, irq_flags);
-
-    if (atomic_cmpxchg(&opaque->owned_by_cpu, 1, 0))
+    if (err)
     {
-        pci_dma_sync_single_for_device(private->pci_dev,
-                                       opaque->dma_handle,
-                                       opaque->buf.len,
-                                       PCI_DMA_FROMDEVICE);
+        dragon_unclaim_buffers(private, buffers + i, count - i);
+        goto unlock;
     }
 
-    atomic_inc(&private->queue_length);
-    dragon_write_reg32(private, 2, opaque->dma_handle);
+    // flush posted writes once per batch
     addr_read = dragon_read_reg32(private, 2);
 
 unlock:
-    spin_unlock(&private->activity_lock);
+    mutex_unlock(&private->activity_lock);
     return err;
 }
 
-static long dragon_dqbuf(dragon_private *private, dragon_buffer *buffer)
+static long dragon_qbuf(dragon_private *private, dragon_buffer *buffer)
 {
-    unsigned long irq_flags;
-    struct list_head *dqlist_next = 0;
-    dragon_buffer_opaque *opaque = 0;
-    long err = 0;
-    int32_t addr_read;
+    if (!buffer)
+    {
+        return -EINVAL;
+    }
 
+    return dragon_queue_buffers(private, buffer, 1);
+}
+
+static void dragon_reset_stats(dragon_stats *stats)
+{
+    int i;
 
-    spin_lock_irqsave(&private->lists_lock, irq_flags);
-    if (!private->dqlist_head)
+    atomic64_set(&stats->irqs, 0);
+    atomic64_set(&stats->completed, 0);
+    atomic64_set(&stats->underruns, 0);
+    atomic64_set(&stats->overwrites, 0);
+    atomic64_set(&stats->dqbuf_eagain, 0);
+    atomic64_set(&stats->sync_cpu_ns, 0);
+    atomic64_set(&stats->sync_cpu_count, 0);
+    stats->peak_queue_length = 0;
+    for (i = 0; i < DRAGON_LATENCY_BUCKETS; i++)
     {
-        err = -EAGAIN;
+        atomic64_set(&stats->latency[i], 0);
     }
-    else
-    {
-        if (!list_empty(private->dqlist_head))
-        {
-            dqlist_next = private->dqlist_head->next;
-        }
+}
 
-        opaque = list_entry(private->dqlist_head, dragon_buffer_opaque, dqlist);
-        *buffer = opaque->buf;
+static void dragon_account_latency(dragon_private *private, uint64_t completed_ns)
+{
+    uint64_t latency_us = div_u64(ktime_get_ns() - completed_ns, NSEC_PER_USEC);
+    int bucket = min(fls64(latency_us), DRAGON_LATENCY_BUCKETS - 1);
 
-        list_del_init(private->dqlist_head);
-        private->dqlist_head = dqlist_next;
-    }
-    spin_unlock_irqrestore(&private->lists_lock, irq_flags);
+    atomic64_inc(&private->stats.latency[bucket]);
+}
 
-    if (!err && !atomic_cmpxchg(&opaque->owned_by_cpu, 0, 1))
-    {
-        addr_read = dragon_read_reg32(private, 2);
-        if (addr_read != (int32_t)opaque->dma_handle)
-        {
-            printk(KERN_INFO "Buffers queue is broken:\n");
-            printk(KERN_INFO "\t opaque->dma_handle = %08x, addr_read = %08x\n",
-                   (int)opaque->dma_handle, addr_read);
-        }
+// Sleep until a completed buffer is available, the device is stopped or
+// *timeout jiffies pass; *timeout is left with the time remaining
+static long dragon_wait_for_buffers(dragon_private *private, long *timeout)
+{
+    long ret;
 
-        pci_dma_sync_single_for_cpu(private->pci_dev,
-                                    addr_read,
-                                    opaque->buf.len,
-                                    PCI_DMA_FROMDEVICE);
-    }
+    if (!*timeout || dragon_index_ring_count(&private->dqring))
+        return 0;
 
-    return err;
+    ret = wait_event_interruptible_timeout(private->wait,
+              dragon_index_ring_count(&private->dqring) ||
+              !READ_ONCE(private->activity),
+              *timeout);
+
+    if (ret < 0)
+        return ret;
+    if (!ret)
+        return -ETIMEDOUT;
+
+    if (*timeout != MAX_SCHEDULE_TIMEOUT)
+        *timeout = ret;
+
+    return 0;
 }
 
-static void dragon_switch_one_buffer(dragon_private *private)
+// Dequeue up to count completed buffers under a single acquisition of
+// dequeue_lock; returns number of dequeued buffers or -EAGAIN if there are none
+static long dragon_dequeue_buffers(dragon_private *private,
+                                   dragon_buffer *buffers, size_t count,
+                                   int32_t timeout_ms)
 {
-    unsigned long irq_flags;
-    struct list_head *qlist_next = 0;
     dragon_buffer_opaque *opaque;
+    uint16_t idx;
+    dragon_buffer_opaque *done[DRAGON_DQBUF_BATCH];
+    size_t i, n = 0;
+    long timeout = timeout_ms < 0 ? MAX_SCHEDULE_TIMEOUT : msecs_to_jiffies(timeout_ms);
+    long ret;
+
+    if (count > DRAGON_DQBUF_BATCH)
+        count = DRAGON_DQBUF_BATCH;
+
+    // overwrite mode or another consumer may take the buffers we woke up
+    // for, so keep waiting while the device runs
+    do
+    {
+        ret = dragon_wait_for_buffers(private, &timeout);
+        if (ret)
+            return ret;
+
+        spin_lock(&private->dequeue_lock);
+        while (n < count && !dragon_index_ring_pop(&private->dqring, &idx))
+        {
+            done[n++] = &private->buffers[idx];
+        }
+        spin_unlock(&private->dequeue_lock);
+    } while (!n && timeout && READ_ONCE(private->activity));
 
-    spin_lock_irqsave(&private->lists_lock, irq_flags);
-    if (!private->qlist_head)
+    if (!n)
     {
-        printk(KERN_INFO "Buffers queue is empty\n");
+        atomic64_inc(&private->stats.dqbuf_eagain);
+        return -EAGAIN;
     }
-    else
+
+    for (i = 0; i < n; i++)
     {
-        if (!list_empty(private->qlist_head))
-        {
-            qlist_next = private->qlist_head->next;
-        }
-        list_del_init(private->qlist_head);
+        opaque = done[i];
 
-        opaque = list_entry(private->qlist_head, dragon_buffer_opaque, qlist);
-        if (private->dqlist_head)
-        {
-            list_add_tail(&opaque->dqlist, private->dqlist_head);
-        }
-        else
+        if (!atomic_cmpxchg(&opaque->owned_by_cpu, 0, 1))
         {
-            private->dqlist_head = &opaque->dqlist;
+            dragon_sync_buffer_for_cpu(private, opaque);
         }
 
-        private->qlist_head = qlist_next;
+        buffers[i] = opaque->buf;
+        atomic_set(&opaque->queued, 0);
+        dragon_account_latency(private, opaque->buf.completed_ns);
+
+        trace_dragon_dqbuf(MINOR(private->cdev_no), opaque->buf.idx,
+                           opaque->chunks[0].dma_handle,
+                           atomic_read(&private->queue_length),
+                           opaque->buf.sequence);
     }
-    spin_unlock_irqrestore(&private->lists_lock, irq_flags);
+
+    return n;
 }
 
-static long dragon_ioctl(struct file *file,
-                        unsigned int cmd, unsigned long arg)
+static long dragon_dqbuf(dragon_private *private, dragon_buffer *buffer,
+                         int nonblock)
 {
-    int err = 0;
-    void* parg = (void*)arg;
-    dragon_private* private = file->private_data;
+    int32_t timeout_ms = buffer->timeout_ms;
+    long ret = dragon_dequeue_buffers(private, buffer, 1,
+                                      nonblock ? 0 : timeout_ms);
 
-    if (!private)
-    {
-        printk(KERN_INFO "private is empty\n");
-        return -1;
-    }
+    // keep the request reusable for the next DQBUF
+    buffer->timeout_ms = timeout_ms;
 
-    switch (cmd)
+    return ret < 0 ? ret : 0;
+}
+
+static long dragon_qbuf_multi(dragon_private *private,
+                              dragon_buffer_multi __user *arg)
+{
+    dragon_buffer_multi multi;
+    dragon_buffer *buffers;
+    long err;
+
+    if (copy_from_user(&multi, arg, sizeof(multi)))
+        return -EFAULT;
+
+    if (!multi.count || multi.count > DRAGON_MAX_BUFFER_COUNT)
+        return -EINVAL;
+
+    buffers = kmalloc(multi.count*sizeof(dragon_buffer), GFP_KERNEL);
+    if (!buffers)
+        return -ENOMEM;
+
+    if (copy_from_user(buffers, multi.buffers,
+                       multi.count*sizeof(dragon_buffer)))
     {
-    case DRAGON_SET_ACTIVITY:
-        err = dragon_set_activity(private, arg);
-        break;
+        err = -EFAULT;
+        goto out;
+    }
 
-    case DRAGON_SET_DAC:
-        dragon_write_reg32(private, 3, arg);
-        break;
+    err = dragon_queue_buffers(private, buffers, multi.count);
 
-    case DRAGON_QUERY_PARAMS:
-        if (parg)
-            *(dragon_params*)parg = private->params;
-        break;
+out:
+    kfree(buffers);
+    return err;
+}
 
-    case DRAGON_SET_PARAMS:
-        if (dragon_check_params(parg))
-            return -EINVAL;
-        err = dragon_write_params(private, parg);
-        break;
+static long dragon_dqbuf_multi(dragon_private *private,
+                               dragon_buffer_multi __user *arg, int nonblock)
+{
+    dragon_buffer_multi multi;
+    dragon_buffer *buffers;
+    long ret;
 
-    case DRAGON_REQUEST_BUFFERS:
-        err = dragon_request_buffers(private, parg);
-        break;
+    if (copy_from_user(&multi, arg, sizeof(multi)))
+        return -EFAULT;
 
-    case DRAGON_RELEASE_BUFFERS:
-        err = dragon_release_buffers(private);
-        break;
+    if (!multi.count || multi.count > DRAGON_MAX_BUFFER_COUNT)
+        return -EINVAL;
 
-    case DRAGON_QUERY_BUFFER:
-        err = dragon_query_buffer(private, parg);
-        break;
+    // no more are dequeued at once anyway
+    multi.count = min_t(uint32_t, multi.count, DRAGON_DQBUF_BATCH);
+    buffers = kmalloc(multi.count*sizeof(dragon_buffer), GFP_KERNEL);
+    if (!buffers)
+        return -ENOMEM;
 
-    case DRAGON_QBUF:
-        err = dragon_qbuf(private, parg);
-        break;
+    ret = dragon_dequeue_buffers(private, buffers, multi.count,
+                                 nonblock ? 0 : multi.timeout_ms);
+    if (ret < 0)
+        goto out;
 
+    multi.count = ret;
+    if (copy_to_user(multi.buffers, buffers, ret*sizeof(dragon_buffer)) ||
+        copy_to_user(arg, &multi, sizeof(multi)))
+    {
+        ret = -EFAULT;
+    }
+
+out:
+    kfree(buffers);
+    return ret;
+}
+
+// state of an IORING_OP_URING_CMD, kept in its pdu
+typedef struct dragon_uring_pdu
+{
+    union
+    {
+        struct list_head list;  // in uring_cmds while waiting for buffers
+        long result;            // to complete with from task work
+    };
+    dragon_buffer_multi __user *multi;
+    unsigned long deadline;     // in jiffies, 0 - wait while the device runs
+} dragon_uring_pdu;
+
+static dragon_uring_pdu *dragon_uring_pdu_of(struct io_uring_cmd *ioucmd)
+{
+    BUILD_BUG_ON(sizeof(dragon_uring_pdu) > sizeof(ioucmd->pdu));
+    return (dragon_uring_pdu*)ioucmd->pdu;
+}
+
+static struct io_uring_cmd *dragon_uring_cmd_of(dragon_uring_pdu *pdu)
+{
+    return container_of((void*)pdu, struct io_uring_cmd, pdu);
+}
+
+// Dequeue for a waiting DQBUF_MULTI command, or park it until dragon_notify(),
+// a stop or its deadline; returns -EIOCBQUEUED if parked
+static long dragon_uring_dqbuf(dragon_private *private,
+                               struct io_uring_cmd *ioucmd)
+{
+    dragon_uring_pdu *pdu = dragon_uring_pdu_of(ioucmd);
+    dragon_uring_pdu *parked;
+    unsigned long irq_flags, earliest;
+    int ready;
+    long ret;
+
+    for (;;)
+    {
+        ret = dragon_dqbuf_multi(private, pdu->multi, 1);
+        if (ret != -EAGAIN || !READ_ONCE(private->activity) ||
+            (pdu->deadline && time_after_eq(jiffies, pdu->deadline)))
+            return ret;
+
+        spin_lock_irqsave(&private->uring_lock, irq_flags);
+        // recheck once parked: a completion before that didn't kick us
+        ready = dragon_index_ring_count(&private->dqring) || !private->activity;
+        if (!ready)
+        {
+            list_add_tail(&pdu->list, &private->uring_cmds);
+
+            earliest = 0;
+            list_for_each_entry(parked, &private->uring_cmds, list)
+            {
+                if (parked->deadline &&
+                    (!earliest || time_before(parked->deadline, earliest)))
+                    earliest = parked->deadline;
+            }
+            if (earliest)
+                mod_delayed_work(system_wq, &private->uring_timeout,
+                                 time_after(earliest, jiffies) ?
+                                 earliest - jiffies : 0);
+        }
+        spin_unlock_irqrestore(&private->uring_lock, irq_flags);
+
+        if (!ready)
+            return -EIOCBQUEUED;
+    }
+}
+
+static void dragon_uring_retry(struct io_uring_cmd *ioucmd)
+{
+    long ret = dragon_uring_dqbuf(ioucmd->file->private_data, ioucmd);
+
+    if (ret != -EIOCBQUEUED)
+        io_uring_cmd_done(ioucmd, ret, 0);
+}
+
+// Hand the parked DQBUF_MULTI commands back to their tasks to retry
+static void dragon_uring_kick(dragon_private *private)
+{
+    dragon_uring_pdu *pdu, *next;
+    unsigned long irq_flags;
+    LIST_HEAD(cmds);
+
+    spin_lock_irqsave(&private->uring_lock, irq_flags);
+    list_splice_init(&private->uring_cmds, &cmds);
+    spin_unlock_irqrestore(&private->uring_lock, irq_flags);
+
+    list_for_each_entry_safe(pdu, next, &cmds, list)
+    {
+        io_uring_cmd_complete_in_task(dragon_uring_cmd_of(pdu),
+                                      dragon_uring_retry);
+    }
+}
+
+static void dragon_uring_timeout(struct work_struct *work)
+{
+    dragon_private *private = container_of(to_delayed_work(work),
+                                           dragon_private, uring_timeout);
+
+    dragon_uring_kick(private);
+}
+
+static void dragon_uring_complete(struct io_uring_cmd *ioucmd)
+{
+    io_uring_cmd_done(ioucmd, dragon_uring_pdu_of(ioucmd)->result, 0);
+}
+
+// Asynchronous QBUF_MULTI and DQBUF_MULTI. QBUF_MULTI never waits and runs
+// inline; DQBUF_MULTI waits for buffers without taking an io-wq thread.
+static int dragon_uring(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+    dragon_private *private = ioucmd->file->private_data;
+    const dragon_uring_cmd *cmd = ioucmd->cmd;
+    dragon_uring_pdu *pdu = dragon_uring_pdu_of(ioucmd);
+    dragon_buffer_multi multi;
+    long ret;
+
+    if (READ_ONCE(cmd->reserved))
+        return -EINVAL;
+    pdu->multi = u64_to_user_ptr(READ_ONCE(cmd->multi));
+
+    switch (ioucmd->cmd_op)
+    {
+    case DRAGON_QBUF_MULTI:
+        ret = dragon_qbuf_multi(private, pdu->multi);
+        break;
+
+    case DRAGON_DQBUF_MULTI:
+        if (copy_from_user(&multi, pdu->multi, sizeof(multi)))
+            return -EFAULT;
+
+        if (!multi.timeout_ms)
+        {
+            ret = dragon_dqbuf_multi(private, pdu->multi, 1);
+            break;
+        }
+
+        pdu->deadline = multi.timeout_ms < 0 ? 0 :
+                        (jiffies + msecs_to_jiffies(multi.timeout_ms)) ?: 1;
+        ret = dragon_uring_dqbuf(private, ioucmd);
+        break;
+
+    default:
+        return -ENOTTY;
+    }
+
+    // io_uring would reissue a command failing with -EAGAIN
+    if (ret == -EAGAIN)
+    {
+        pdu->result = ret;
+        io_uring_cmd_complete_in_task(ioucmd, dragon_uring_complete);
+        return -EIOCBQUEUED;
+    }
+
+    return ret;
+}
+
+// Streaming interface: read() and splice_read() hand out the payload of
+// completed buffers in order and queue every buffer back to the device
+// once it was read through and no pipe references its pages any more.
+
+static void dragon_stream_put(dragon_buffer_opaque *opaque)
+{
+    dragon_private *private = opaque->private;
+
+    if (atomic_dec_and_test(&opaque->stream_refs))
+    {
+        atomic_dec(&private->stream_buffers);
+        // fails harmlessly if the device was stopped meanwhile
+        dragon_queue_buffers(private, &opaque->buf, 1);
+    }
+}
+
+// Make sure there's a buffer to read from; called with read_lock held
+static long dragon_stream_next(dragon_private *private, int block)
+{
+    dragon_buffer buf;
+    long ret;
+
+    if (private->read_buf)
+        return 0;
+
+    if (private->ring_mode)
+        return -EBUSY;
+
+    ret = dragon_dequeue_buffers(private, &buf, 1, block ? -1 : 0);
+    if (ret < 0)
+        return ret;
+
+    private->read_buf = &private->buffers[buf.idx];
+    private->read_pos = 0;
+    atomic_set(&private->read_buf->stream_refs, 1);
+    atomic_inc(&private->stream_buffers);
+
+    return 0;
+}
+
+// Contiguous bytes at the read position, chunks aren't adjacent in memory
+static size_t dragon_stream_span(dragon_private *private, void **ptr)
+{
+    size_t chunk = private->read_pos / private->buf_chunk_size;
+    size_t offset = private->read_pos % private->buf_chunk_size;
+
+    *ptr = (char*)private->read_buf->chunks[chunk].ptr + offset;
+
+    return private->buf_chunk_size - offset;
+}
+
+static void dragon_stream_advance(dragon_private *private, size_t len)
+{
+    dragon_buffer_opaque *opaque = private->read_buf;
+
+    private->read_pos += len;
+    if (private->read_pos >= opaque->buf.len)
+    {
+        private->read_buf = 0;
+        dragon_stream_put(opaque);
+    }
+}
+
+// Also serves asynchronous readers such as io_uring: with IOCB_NOWAIT it
+// returns -EAGAIN instead of sleeping, and they retry once poll() reports
+// a completed buffer
+static ssize_t dragon_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    dragon_private *private = iocb->ki_filp->private_data;
+    size_t count = iov_iter_count(to);
+    size_t done = 0, len, copied;
+    void *ptr;
+    long err = 0;
+    int nowait = (iocb->ki_flags & IOCB_NOWAIT) ||
+                 (iocb->ki_filp->f_flags & O_NONBLOCK);
+
+    if (nowait)
+    {
+        if (!mutex_trylock(&private->read_lock))
+            return -EAGAIN;
+    }
+    else if (mutex_lock_interruptible(&private->read_lock))
+    {
+        return -ERESTARTSYS;
+    }
+
+    while (done < count)
+    {
+        // only wait for the first byte
+        err = dragon_stream_next(private, !done && !nowait);
+        if (err)
+            break;
+
+        len = min(dragon_stream_span(private, &ptr), count - done);
+        copied = copy_to_iter(ptr, len, to);
+        done += copied;
+        dragon_stream_advance(private, copied);
+        if (copied != len)
+        {
+            err = -EFAULT;
+            break;
+        }
+    }
+
+    mutex_unlock(&private->read_lock);
+    return done ? done : err;
+}
+
+static void dragon_pipe_buf_release(struct pipe_inode_info *pipe,
+                                    struct pipe_buffer *buf)
+{
+    dragon_buffer_opaque *opaque = (dragon_buffer_opaque*)buf->private;
+    struct file *file = opaque->stream_file;
+
+    dragon_stream_put(opaque);
+    fput(file);
+}
+
+static bool dragon_pipe_buf_get(struct pipe_inode_info *pipe,
+                                 struct pipe_buffer *buf)
+{
+    dragon_buffer_opaque *opaque = (dragon_buffer_opaque*)buf->private;
+
+    atomic_inc(&opaque->stream_refs);
+    get_file(opaque->stream_file);
+
+    return true;
+}
+
+// Pages are always up to date, and without .try_steal they are never given
+// away: the device reuses them
+static const struct pipe_buf_operations dragon_pipe_buf_ops = {
+    .release = dragon_pipe_buf_release,
+    .get = dragon_pipe_buf_get,
+};
+
+// pages splice_to_pipe() didn't take
+static void dragon_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+    dragon_buffer_opaque *opaque = (dragon_buffer_opaque*)spd->partial[i].private;
+
+    dragon_stream_put(opaque);
+    fput(opaque->stream_file);
+}
+
+static ssize_t dragon_splice_read(struct file *file, loff_t *ppos,
+                                  struct pipe_inode_info *pipe, size_t len,
+                                  unsigned int flags)
+{
+    dragon_private *private = file->private_data;
+    dragon_buffer_opaque *opaque;
+    struct page *pages[PIPE_DEF_BUFFERS];
+    struct partial_page partial[PIPE_DEF_BUFFERS];
+    struct splice_pipe_desc spd = {
+        .pages = pages,
+        .partial = partial,
+        .nr_pages = 0,
+        .nr_pages_max = PIPE_DEF_BUFFERS,
+        .ops = &dragon_pipe_buf_ops,
+        .spd_release = dragon_spd_release,
+    };
+    size_t pos, span, offset;
+    void *ptr;
+    ssize_t ret;
+
+    if (mutex_lock_interruptible(&private->read_lock))
+        return -ERESTARTSYS;
+
+    // coherent chunks may be vmap()ed or lack page references for the pipe
+    if (private->buf_coherent && private->pci_dev)
+    {
+        ret = -EINVAL;
+        goto unlock;
+    }
+
+    ret = dragon_stream_next(private, !(flags & SPLICE_F_NONBLOCK) &&
+                                      !(file->f_flags & O_NONBLOCK));
+    if (ret)
+        goto unlock;
+
+    // lend the pages of the current buffer, each holding a buffer reference
+    opaque = private->read_buf;
+    opaque->stream_file = file;
+    pos = private->read_pos;
+    while (spd.nr_pages < PIPE_DEF_BUFFERS && len &&
+           private->read_pos < opaque->buf.len)
+    {
+        span = dragon_stream_span(private, &ptr);
+        offset = offset_in_page(ptr);
+        span = min(min(span, (size_t)PAGE_SIZE - offset), len);
+
+        pages[spd.nr_pages] = virt_to_page(ptr);
+        partial[spd.nr_pages].offset = offset;
+        partial[spd.nr_pages].len = span;
+        partial[spd.nr_pages].private = (unsigned long)opaque;
+        spd.nr_pages++;
+
+        atomic_inc(&opaque->stream_refs);
+        get_file(file);
+
+        // dragon_stream_span() works from read_pos
+        private->read_pos += span;
+        len -= span;
+    }
+    // advanced below by what the pipe actually took
+    private->read_pos = pos;
+
+    ret = splice_to_pipe(pipe, &spd);
+    if (ret > 0)
+        dragon_stream_advance(private, ret);
+
+unlock:
+    mutex_unlock(&private->read_lock);
+    return ret;
+}
+
+// Publish a completed buffer to the shared ring; called from the completion
+// thread only
+static int dragon_ring_complete(dragon_private *private,
+                                dragon_buffer_opaque *opaque)
+{
+    dragon_ring *ring = private->ring;
+    uint32_t head = ring->done_head;
+
+    // never happens unless userspace corrupted done_tail
+    if (head - READ_ONCE(ring->done_tail) >= DRAGON_RING_SIZE)
+        return -ENOSPC;
+
+    if (!atomic_cmpxchg(&opaque->owned_by_cpu, 0, 1))
+    {
+        dragon_sync_buffer_for_cpu(private, opaque);
+    }
+
+    atomic_set(&opaque->queued, 0);
+    ring->done[head & (DRAGON_RING_SIZE - 1)] = opaque->buf.idx;
+    smp_store_release(&ring->done_head, head + 1);
+
+    return 0;
+}
+
+// Feed buffers returned by userspace through the requeue ring back to the
+// device in batches: indices are copied out of the shared page and synced
+// before submit_lock is taken. Indices out of range or of buffers the driver
+// holds are skipped and flagged. Called from the completion thread and poll().
+static void dragon_ring_requeue(dragon_private *private)
+{
+    dragon_ring *ring = private->ring;
+    unsigned long irq_flags;
+    uint32_t tail, head, i, n;
+    uint16_t batch[DRAGON_DQBUF_BATCH];
+
+    mutex_lock(&private->requeue_lock);
+    if (!READ_ONCE(private->activity))
+        goto unlock;
+
+    tail = ring->requeue_tail;
+    head = smp_load_acquire(&ring->requeue_head);
+    if (head - tail > DRAGON_RING_SIZE)
+        tail = head - DRAGON_RING_SIZE;
+
+    while (tail != head)
+    {
+        for (n = 0; n < DRAGON_DQBUF_BATCH && tail != head; tail++)
+        {
+            batch[n] = READ_ONCE(ring->requeue[tail & (DRAGON_RING_SIZE - 1)]);
+            if (batch[n] >= private->buf_count ||
+                dragon_claim_buffer(&private->buffers[batch[n]]))
+            {
+                private->ring_rejected = 1;
+                continue;
+            }
+            dragon_prepare_buffer(private, &private->buffers[batch[n++]]);
+        }
+
+        spin_lock_irqsave(&private->submit_lock, irq_flags);
+        for (i = 0; i < n; i++)
+        {
+            if (!private->activity ||
+                dragon_submit_buffer(private, &private->buffers[batch[i]]))
+            {
+                // back to userspace, which learns from the flag
+                atomic_set(&private->buffers[batch[i]].queued, 0);
+                private->ring_rejected = 1;
+            }
+        }
+        spin_unlock_irqrestore(&private->submit_lock, irq_flags);
+    }
+    smp_store_release(&ring->requeue_tail, tail);
+
+    WRITE_ONCE(ring->flags,
+               (atomic_read(&private->queue_length) ? 0 : DRAGON_RING_NEED_KICK) |
+               (private->ring_rejected ? DRAGON_RING_REJECTED : 0));
+
+unlock:
+    mutex_unlock(&private->requeue_lock);
+}
+
+static long dragon_set_ring_mode(dragon_private *private, int arg)
+{
+    unsigned long irq_flags;
+    long err = 0;
+
+    mutex_lock(&private->activity_lock);
+    if (private->activity)
+    {
+        printk(KERN_INFO "Couldn't switch ring mode while in active mode\n");
+        err = -EAGAIN;
+        goto unlock;
+    }
+
+    spin_lock_irqsave(&private->submit_lock, irq_flags);
+    private->ring->done_head = 0;
+    private->ring->done_tail = 0;
+    private->ring->requeue_head = 0;
+    private->ring->requeue_tail = 0;
+    private->ring->flags = 0;
+    private->ring_rejected = 0;
+    private->ring_mode = !!arg;
+    spin_unlock_irqrestore(&private->submit_lock, irq_flags);
+
+unlock:
+    mutex_unlock(&private->activity_lock);
+    return err;
+}
+
+// Move the oldest queued buffer to the completed ones; runs in the
+// completion thread, the only consumer of qring and producer of dqring
+static void dragon_switch_one_buffer(dragon_private *private)
+{
+    uint16_t idx;
+
+    if (dragon_index_ring_pop(&private->qring, &idx))
+    {
+        return;
+    }
+
+    private->buffers[idx].buf.sequence = private->sequence++;
+    private->buffers[idx].buf.len = private->buf_chunks*private->buf_chunk_size;
+    private->buffers[idx].buf.completed_ns = READ_ONCE(private->irq_ns);
+
+    trace_dragon_switch_one_buffer(MINOR(private->cdev_no), idx,
+                                   private->buffers[idx].chunks[0].dma_handle,
+                                   atomic_read(&private->queue_length),
+                                   private->buffers[idx].buf.sequence);
+
+    if (private->ring_mode && !dragon_ring_complete(private, &private->buffers[idx]))
+    {
+        // published to userspace directly
+        return;
+    }
+
+    dragon_index_ring_push(&private->dqring, idx);
+}
+
+// End a pending reconfiguration, with or without its params, and release
+// the buffers held meanwhile: to the device while it runs, otherwise back
+// to userspace. Called with submit_lock held.
+static void dragon_finish_reconfig(dragon_private *private, int apply)
+{
+    uint16_t idx;
+
+    private->reconfig_pending = 0;
+    if (apply)
+    {
+        dragon_apply_params(private, &private->reconfig_params);
+    }
+
+    while (!dragon_index_ring_pop(&private->hold, &idx))
+    {
+        if (!private->activity ||
+            dragon_submit_buffer(private, &private->buffers[idx]))
+        {
+            atomic_set(&private->buffers[idx].queued, 0);
+        }
+    }
+
+    wake_up_interruptible(&private->wait);
+}
+
+// Change params while active. Params that keep the buffer layout (pulse
+// mask, sync, channel, DAC) are written at once. A new frame length or
+// count must fit the allocated buffers and takes effect at the next buffer
+// boundary where the device has drained its queue, while newly queued
+// buffers are held. Draining takes as long as the queued buffers take to
+// fill, which no fixed budget fits, so by default only a stop (which
+// applies the change) or a signal ends the wait; a nonzero
+// reconfig_timeout_ms drops the change after that long.
+static long dragon_reconfigure(dragon_private *private, dragon_params *params)
+{
+    unsigned long irq_flags;
+    uint32_t chunks, chunk_size;
+    long err = 0;
+
+    if (dragon_check_params(params))
+        return -EINVAL;
+
+    mutex_lock(&private->reconfig_lock);
+    mutex_lock(&private->activity_lock);
+    if (!private->activity)
+    {
+        dragon_apply_params(private, params);
+        goto unlock;
+    }
+
+    if (params->frame_length == private->params.frame_length &&
+        params->frames_per_buffer == private->params.frames_per_buffer)
+    {
+        spin_lock_irqsave(&private->submit_lock, irq_flags);
+        dragon_apply_params(private, params);
+        spin_unlock_irqrestore(&private->submit_lock, irq_flags);
+        goto unlock;
+    }
+
+    dragon_buffer_layout(params, &chunks, &chunk_size);
+    if (!private->buffers || chunks != private->buf_chunks ||
+        (chunks > 1 && chunk_size != private->buf_chunk_size) ||
+        get_order(chunk_size) > private->buf_order)
+    {
+        printk(KERN_INFO "Couldn't change buffer layout while in active mode\n");
+        err = -EINVAL;
+        goto unlock;
+    }
+
+    spin_lock_irqsave(&private->submit_lock, irq_flags);
+    private->reconfig_params = *params;
+    private->reconfig_pending = 1;
+    if (!atomic_read(&private->queue_length))
+    {
+        dragon_finish_reconfig(private, 1);
+    }
+    spin_unlock_irqrestore(&private->submit_lock, irq_flags);
+
+    // QBUF and stopping need activity_lock meanwhile
+    mutex_unlock(&private->activity_lock);
+
+    err = wait_event_interruptible_timeout(private->wait,
+              !READ_ONCE(private->reconfig_pending),
+              dragon_reconfig_timeout_ms ?
+              msecs_to_jiffies(dragon_reconfig_timeout_ms) : MAX_SCHEDULE_TIMEOUT);
+    if (err > 0)
+    {
+        mutex_unlock(&private->reconfig_lock);
+        return 0;
+    }
+
+    // the device didn't drain in time or we were interrupted: drop the change
+    spin_lock_irqsave(&private->submit_lock, irq_flags);
+    if (private->reconfig_pending)
+    {
+        dragon_finish_reconfig(private, 0);
+        if (!err)
+            err = -ETIMEDOUT;
+    }
+    else
+    {
+        err = 0;
+    }
+    spin_unlock_irqrestore(&private->submit_lock, irq_flags);
+
+    mutex_unlock(&private->reconfig_lock);
+    return err;
+
+unlock:
+    mutex_unlock(&private->activity_lock);
+    mutex_unlock(&private->reconfig_lock);
+    return err;
+}
+
+static long dragon_set_overwrite(dragon_private *private, int arg)
+{
+    mutex_lock(&private->activity_lock);
+    WRITE_ONCE(private->overwrite_mode, !!arg);
+    mutex_unlock(&private->activity_lock);
+
+    return 0;
+}
+
+// Register an eventfd to count completed buffers on; fd < 0 unregisters
+static long dragon_set_eventfd(dragon_private *private, int fd)
+{
+    unsigned long irq_flags;
+    struct eventfd_ctx *ctx = 0, *old;
+
+    if (fd >= 0)
+    {
+        ctx = eventfd_ctx_fdget(fd);
+        if (IS_ERR(ctx))
+            return PTR_ERR(ctx);
+    }
+
+    spin_lock_irqsave(&private->eventfd_lock, irq_flags);
+    old = private->eventfd;
+    private->eventfd = ctx;
+    spin_unlock_irqrestore(&private->eventfd_lock, irq_flags);
+
+    if (old)
+        eventfd_ctx_put(old);
+
+    return 0;
+}
+
+// QUERY_BUFFER, QBUF and DQBUF on a dragon_buffer in user memory, or on a
+// dragon_buffer_v1 for the _V1 numbers
+static long dragon_buffer_ioctl(dragon_private *private, unsigned int cmd,
+                                void __user *arg, int nonblock)
+{
+    dragon_buffer buf;
+    dragon_buffer_v1 buf_v1;
+    int v1 = cmd == DRAGON_QUERY_BUFFER_V1 || cmd == DRAGON_QBUF_V1 ||
+             cmd == DRAGON_DQBUF_V1;
+    long err;
+
+    memset(&buf, 0, sizeof(buf));
+    if (v1)
+    {
+        if (copy_from_user(&buf_v1, arg, sizeof(buf_v1)))
+            return -EFAULT;
+        // timeout_ms stays 0: DQBUF didn't wait before
+        buf.idx = buf_v1.idx;
+    }
+    else if (copy_from_user(&buf, arg, sizeof(buf)))
+    {
+        return -EFAULT;
+    }
+
+    if (cmd == DRAGON_QUERY_BUFFER || cmd == DRAGON_QUERY_BUFFER_V1)
+        err = dragon_query_buffer(private, &buf);
+    else if (cmd == DRAGON_QBUF || cmd == DRAGON_QBUF_V1)
+        err = dragon_qbuf(private, &buf);
+    else
+        err = dragon_dqbuf(private, &buf, nonblock);
+
+    if (err)
+        return err;
+
+    if (v1)
+    {
+        buf_v1.idx = buf.idx;
+        buf_v1.ptr = buf.ptr;
+        buf_v1.len = buf.len;
+        buf_v1.offset = buf.offset;
+        return copy_to_user(arg, &buf_v1, sizeof(buf_v1)) ? -EFAULT : 0;
+    }
+
+    return copy_to_user(arg, &buf, sizeof(buf)) ? -EFAULT : 0;
+}
+
+static long dragon_ioctl(struct file *file,
+                        unsigned int cmd, unsigned long arg)
+{
+    int err = 0;
+    void __user *parg = (void __user *)arg;
+    dragon_private* private = file->private_data;
+    dragon_params params;
+    dragon_request request;
+    size_t count;
+
+    if (!private)
+    {
+        printk(KERN_INFO "private is empty\n");
+        return -1;
+    }
+
+    switch (cmd)
+    {
+    case DRAGON_SET_ACTIVITY:
+        err = dragon_set_activity(private, arg);
+        break;
+
+    case DRAGON_SET_DAC:
+        dragon_write_reg32(private, 3, arg);
+        break;
+
+    case DRAGON_QUERY_PARAMS:
+        if (copy_to_user(parg, &private->params, sizeof(params)))
+            return -EFAULT;
+        break;
+
+    case DRAGON_SET_PARAMS:
+        if (copy_from_user(&params, parg, sizeof(params)))
+            return -EFAULT;
+        if (dragon_check_params(&params))
+            return -EINVAL;
+        // userspace sees the rounded values
+        if (copy_to_user(parg, &params, sizeof(params)))
+            return -EFAULT;
+        err = dragon_write_params(private, &params);
+        break;
+
+    case DRAGON_REQUEST_BUFFERS:
+        if (copy_from_user(&count, parg, sizeof(count)))
+            return -EFAULT;
+        err = dragon_request_buffers(private, &count, 0, NUMA_NO_NODE);
+        if (copy_to_user(parg, &count, sizeof(count)))
+            return -EFAULT;
+        break;
+
+    case DRAGON_REQUEST_BUFFERS_EX:
+        if (copy_from_user(&request, parg, sizeof(request)))
+            return -EFAULT;
+        err = dragon_request_buffers(private, &request.count, request.flags,
+                                     (request.flags & DRAGON_REQUEST_NODE) ?
+                                     request.node : NUMA_NO_NODE);
+        if (!err)
+            request.node = private->buf_mem_node;
+        if (copy_to_user(parg, &request, sizeof(request)))
+            return -EFAULT;
+        break;
+
+    case DRAGON_RELEASE_BUFFERS:
+        err = dragon_release_buffers(private);
+        break;
+
+    case DRAGON_QUERY_BUFFER:
+    case DRAGON_QBUF:
     case DRAGON_DQBUF:
-        err = dragon_dqbuf(private, parg);
+    case DRAGON_QUERY_BUFFER_V1:
+    case DRAGON_QBUF_V1:
+    case DRAGON_DQBUF_V1:
+        err = dragon_buffer_ioctl(private, cmd, parg, file->f_flags & O_NONBLOCK);
+        break;
+
+    case DRAGON_QBUF_MULTI:
+        err = dragon_qbuf_multi(private, parg);
+        break;
+
+    case DRAGON_DQBUF_MULTI:
+        err = dragon_dqbuf_multi(private, parg, file->f_flags & O_NONBLOCK);
+        if (err > 0)
+            err = 0;
+        break;
+
+    case DRAGON_SET_RING:
+        err = dragon_set_ring_mode(private, arg);
+        break;
+
+    case DRAGON_SET_EVENTFD:
+        err = dragon_set_eventfd(private, (int)arg);
         break;
+
+    case DRAGON_RECONFIGURE:
+        if (copy_from_user(&params, parg, sizeof(params)))
+            return -EFAULT;
+        err = dragon_reconfigure(private, &params);
+        // rounded by dragon_check_params(), as with SET_PARAMS
+        if (!err && copy_to_user(parg, &params, sizeof(params)))
+            return -EFAULT;
+        break;
+
+    case DRAGON_SET_OVERWRITE:
+        err = dragon_set_overwrite(private, arg);
+        break;
+
     case DRAGON_GET_ID:
-        if(parg)
-            *(uint32_t*)parg = dragon_read_reg32(private, 8);
+        if (put_user(dragon_read_reg32(private, 8), (uint32_t __user *)parg))
+            return -EFAULT;
         break;
 
-    default: err = -EINVAL;
+    default: err = -EINVAL;
+    }
+
+    return err;
+}
+
+
+// Work out how many queued chunks the device has finished. Reg 2 reads back
+// the DMA address of the last completed chunk, so everything up to its
+// position in qring is done; this also recovers from MSIs that got merged
+// or lost. irqs is the number of MSIs (one per chunk) taken since the
+// previous pass and disambiguates a stale readback from a chunk that went
+// full circle.
+static uint32_t dragon_count_completed(dragon_private *private,
+                                       uint32_t addr, uint32_t irqs,
+                                       uint32_t queued)
+{
+    uint32_t tail = private->qring.tail;
+    uint32_t chunk = private->head_chunk;
+    uint32_t i;
+    uint16_t idx;
+
+    // queued includes the chunks of the oldest buffer already done
+    queued -= private->head_chunk;
+
+    for (i = 0; i < queued; i++, chunk++)
+    {
+        idx = private->qring.idx[(tail + (chunk / private->buf_chunks)) &
+                                 (DRAGON_MAX_BUFFER_COUNT - 1)];
+        if ((uint32_t)private->buffers[idx].chunks[chunk % private->buf_chunks].dma_handle == addr)
+        {
+            if (addr != private->last_done || irqs > i)
+                return i + 1;
+            break;
+        }
+    }
+
+    return min(irqs, queued);
+}
+
+// Report completed buffers to waiters and to the registered eventfd, which
+// counts them
+static void dragon_notify(dragon_private *private, uint32_t completed)
+{
+    unsigned long irq_flags;
+
+    if (!completed)
+        return;
+
+    wake_up_interruptible(&private->wait);
+    dragon_uring_kick(private);
+
+    spin_lock_irqsave(&private->eventfd_lock, irq_flags);
+    if (private->eventfd)
+        eventfd_signal(private->eventfd, completed);
+    spin_unlock_irqrestore(&private->eventfd_lock, irq_flags);
+}
+
+static enum hrtimer_restart dragon_wake_timer(struct hrtimer *timer)
+{
+    dragon_private *private = container_of(timer, dragon_private, wake_timer);
+
+    dragon_notify(private, atomic_xchg(&private->wake_pending, 0));
+
+    return HRTIMER_NORESTART;
+}
+
+// Wake consumers once coalesce_count buffers have accumulated, at least
+// every coalesce_usecs while completions keep coming, and right away when
+// the device has nothing left to complete
+static void dragon_coalesce_wakeup(dragon_private *private, uint32_t completed)
+{
+    ktime_t now = ktime_get();
+    uint32_t pending = atomic_add_return(completed, &private->wake_pending);
+
+    if (!pending)
+        return;
+
+    if (pending >= dragon_coalesce_count ||
+        !atomic_read(&private->queue_length) ||
+        (dragon_coalesce_usecs &&
+         ktime_to_ns(ktime_sub(now, private->last_wake)) >=
+             (s64)dragon_coalesce_usecs*NSEC_PER_USEC))
+    {
+        private->last_wake = now;
+        dragon_notify(private, atomic_xchg(&private->wake_pending, 0));
+        return;
+    }
+
+    // without a time limit the tail waits for more buffers or a drained queue
+    if (!dragon_coalesce_usecs)
+        return;
+
+    // flush the tail once completions stop
+    hrtimer_start(&private->wake_timer,
+                  ns_to_ktime((u64)dragon_coalesce_usecs*NSEC_PER_USEC),
+                  HRTIMER_MODE_REL);
+}
+
+// Overwrite mode: when the device is about to run dry, take back the oldest
+// completed buffers the consumer hasn't dequeued yet and queue them again.
+// Runs in the completion thread, the dqring producer, so a buffer that
+// can't be queued is simply put back.
+static void dragon_overwrite_oldest(dragon_private *private)
+{
+    unsigned long irq_flags;
+    uint16_t idx;
+    int err;
+
+    while (dragon_index_ring_count(&private->qring) < DRAGON_OVERWRITE_MIN_QUEUED)
+    {
+        // the oldest stays in dqring until it is resubmitted, so a failure
+        // leaves the completion order DQBUF sees untouched
+        spin_lock(&private->dequeue_lock);
+        err = dragon_index_ring_peek(&private->dqring, &idx);
+        if (!err)
+        {
+            dragon_prepare_buffer(private, &private->buffers[idx]);
+            spin_lock_irqsave(&private->submit_lock, irq_flags);
+            err = private->activity ?
+                dragon_submit_buffer(private, &private->buffers[idx]) : -EAGAIN;
+            spin_unlock_irqrestore(&private->submit_lock, irq_flags);
+        }
+        if (!err)
+        {
+            dragon_index_ring_pop(&private->dqring, &idx);
+        }
+        spin_unlock(&private->dequeue_lock);
+
+        if (err)
+            return;
+
+        atomic64_inc(&private->stats.overwrites);
+    }
+}
+
+// Retire every buffer the device has finished in one pass; a buffer of
+// several chunks is retired with its last chunk
+static void dragon_complete_buffers(dragon_private *private)
+{
+    unsigned long irq_flags;
+    uint32_t irqs = atomic_xchg(&private->irq_pending, 0);
+    uint32_t queued = atomic_read(&private->queue_length);
+    uint32_t addr, chunks, completed, i;
+
+    if (!queued)
+    {
+        return;
+    }
+
+    addr = dragon_read_reg32(private, 2);
+    chunks = dragon_count_completed(private, addr, irqs, queued);
+
+    chunks += private->head_chunk;
+    completed = chunks / private->buf_chunks;
+    private->head_chunk = chunks % private->buf_chunks;
+
+    trace_dragon_complete_buffers(MINOR(private->cdev_no), addr, irqs,
+                                  queued, completed);
+
+    for (i = 0; i < completed; i++)
+    {
+        dragon_switch_one_buffer(private);
+    }
+
+    // the device is at a buffer boundary with nothing left to fill
+    if (private->reconfig_pending)
+    {
+        spin_lock_irqsave(&private->submit_lock, irq_flags);
+        if (private->reconfig_pending &&
+            atomic_read(&private->queue_length) == chunks - private->head_chunk)
+        {
+            dragon_finish_reconfig(private, 1);
+        }
+        spin_unlock_irqrestore(&private->submit_lock, irq_flags);
+    }
+    atomic_sub(chunks - private->head_chunk, &private->queue_length);
+    private->last_done = addr;
+
+    atomic64_add(completed, &private->stats.completed);
+    if (READ_ONCE(private->overwrite_mode))
+    {
+        dragon_overwrite_oldest(private);
+    }
+    if (completed && private->activity && !atomic_read(&private->queue_length))
+    {
+        atomic64_inc(&private->stats.underruns);
+    }
+
+    if (private->ring_mode)
+    {
+        dragon_ring_requeue(private);
     }
 
-    return err;
+    dragon_coalesce_wakeup(private, completed);
 }
 
-
 static irqreturn_t dragon_irq_handler(int irq, void *data)
 {
     dragon_private *private = data;
 
-    if (!private || private->pci_dev->irq != irq)
+    if (!private || (private->pci_dev && private->pci_dev->irq != irq))
     {
         return IRQ_NONE;
     }
 
-    dragon_switch_one_buffer(private);
-    wake_up_interruptible(&private->wait);
-    atomic_dec(&private->queue_length);
+    // buffers retired in one threaded pass share the latest MSI time
+    WRITE_ONCE(private->irq_ns, ktime_get_ns());
+    atomic64_inc(&private->stats.irqs);
+
+    trace_dragon_irq_handler(MINOR(private->cdev_no),
+                             atomic_inc_return(&private->irq_pending));
+
+    return IRQ_WAKE_THREAD;
+}
+
+static irqreturn_t dragon_irq_thread(int irq, void *data)
+{
+    dragon_private *private = data;
+
+    dragon_complete_buffers(private);
 
     return IRQ_HANDLED;
 }
 
+static const struct cpumask *dragon_local_cpus(dragon_private *private)
+{
+    if (private->dev_node == NUMA_NO_NODE)
+        return cpu_online_mask;
+
+    return cpumask_of_node(private->dev_node);
+}
+
 static int dragon_open(struct inode *inode, struct file *file)
 {
     dragon_private* private;
@@ -745,26 +2771,56 @@ static int dragon_open(struct inode *inode, struct file *file)
     // Disable device activity just in case
     dragon_set_activity(private, 0);
 
-    //Init wait queue head and spin locks
-    init_waitqueue_head(&private->wait);
-    spin_lock_init(&private->lists_lock);
-    spin_lock_init(&private->page_table_lock);
-    spin_lock_init(&private->activity_lock);
+    private->read_buf = 0;
+    atomic_set(&private->stream_buffers, 0);
     atomic_set(&private->queue_length, 0);
+    dragon_reset_stats(&private->stats);
+    atomic_set(&private->irq_pending, 0);
+    atomic_set(&private->wake_pending, 0);
+    private->last_done = 0;
+    private->last_wake = ktime_get();
+
+    private->overwrite_mode = 0;
+    private->eventfd = 0;
+    private->reconfig_pending = 0;
+    dragon_index_ring_reset(&private->hold);
+
+    //Init shared completion ring, disabled until DRAGON_SET_RING
+    private->ring_mode = 0;
+    private->ring = (dragon_ring*)get_zeroed_page(GFP_KERNEL);
+    if (!private->ring)
+    {
+        printk(KERN_INFO "dragon ring allocation failed\n");
+        atomic_inc(&private->dev_available);
+        return -ENOMEM;
+    }
+    dragon_lock_pages(private, private->ring, PAGE_SIZE);
 
-    //Init IRQ
-    if ( request_irq(private->pci_dev->irq, dragon_irq_handler, 0,
-                     private->dev_name, private) )
+    //Init IRQ, emulated devices raise completions from their timer
+    if ( private->pci_dev &&
+         request_threaded_irq(private->pci_dev->irq, dragon_irq_handler,
+                              dragon_irq_thread, 0,
+                              private->dev_name, private) )
     {
         printk(KERN_INFO "request_irq() failed\n");
+        dragon_unlock_pages(private, private->ring, PAGE_SIZE);
+        free_page((unsigned long)private->ring);
+        private->ring = 0;
         return -1;
     }
 
+    // completions are handled best next to the board and its buffers
+    if (private->pci_dev)
+        irq_set_affinity_hint(private->pci_dev->irq, dragon_local_cpus(private));
+
     //Write default params to device
     dragon_params_set_defaults(&private->params);
     dragon_check_params(&private->params);
     dragon_write_params(private, NULL);
 
+    // let io_uring try reads inline and fall back to poll
+    file->f_mode |= FMODE_NOWAIT;
+
     printk(KERN_INFO "successfully open dragon device %d\n", MINOR(private->cdev_no));
 
     return 0;
@@ -789,9 +2845,24 @@ static int dragon_release(struct inode *inode, struct file *file)
 
     dragon_set_activity(private, 0);
 
-    free_irq(private->pci_dev->irq, private);
+    if (private->pci_dev)
+    {
+        irq_set_affinity_hint(private->pci_dev->irq, NULL);
+        free_irq(private->pci_dev->irq, private);
+    }
+    else
+        flush_work(&private->emu->irq_work);
+    hrtimer_cancel(&private->wake_timer);
+    cancel_delayed_work_sync(&private->uring_timeout);
+    dragon_set_eventfd(private, -1);
 
     dragon_release_buffers(private);
+    private->mapping = 0;
+
+    private->ring_mode = 0;
+    dragon_unlock_pages(private, private->ring, PAGE_SIZE);
+    free_page((unsigned long)private->ring);
+    private->ring = 0;
 
     file->private_data = 0;
 
@@ -802,42 +2873,166 @@ static int dragon_release(struct inode *inode, struct file *file)
     return 0;
 }
 
-static unsigned int dragon_poll(struct file *file, struct poll_table_struct *poll_table)
+static int dragon_poll_ready(dragon_private *private)
+{
+    if (dragon_index_ring_count(&private->dqring))
+        return 1;
+
+    return private->ring_mode &&
+        private->ring->done_head != READ_ONCE(private->ring->done_tail);
+}
+
+static __poll_t dragon_poll(struct file *file, struct poll_table_struct *poll_table)
 {
-    unsigned long irq_flags;
     dragon_private *private = file->private_data;
-    unsigned int ret = 0;
 
-    spin_lock_irqsave(&private->lists_lock, irq_flags);
-    if (private->dqlist_head)
+    if (private->ring_mode)
     {
-        ret = POLLIN | POLLRDNORM;
+        // poll() is also the kick for buffers requeued to a starved device
+        dragon_ring_requeue(private);
     }
-    spin_unlock_irqrestore(&private->lists_lock, irq_flags);
 
-    if (!ret)
+    if (dragon_poll_ready(private))
     {
-        poll_wait(file, &private->wait, poll_table);
+        return EPOLLIN | EPOLLRDNORM;
+    }
 
-        spin_lock_irqsave(&private->lists_lock, irq_flags);
-        if (private->dqlist_head)
-        {
-            ret = POLLIN | POLLRDNORM;
-        }
-        spin_unlock_irqrestore(&private->lists_lock, irq_flags);
+    poll_wait(file, &private->wait, poll_table);
+
+    if (dragon_poll_ready(private))
+    {
+        return EPOLLIN | EPOLLRDNORM;
+    }
+
+    return 0;
+}
+
+// Buffers are mapped back to back at their buf.offset, each one as its
+// chunks' payloads one after another. Pages are inserted on fault from the
+// kernel addresses of the chunks, so bus addresses (IOMMU) don't matter, and
+// whole PMDs are used where a chunk covers an aligned 2 MiB range.
+static int dragon_mmap_lookup(dragon_private *private, unsigned long pgoff,
+                              unsigned long size, unsigned long *pfn)
+{
+    size_t offset = pgoff << PAGE_SHIFT;
+    size_t span, within;
+    dragon_buffer_opaque *opaque;
+    char *ptr;
+
+    if (!private->buffers || offset/private->buf_map_size >= private->buf_count)
+        return -EINVAL;
+
+    opaque = &private->buffers[offset/private->buf_map_size];
+    within = offset % private->buf_map_size;
+    span = private->buf_chunks == 1 ? private->buf_chunk_alloc : private->buf_chunk_size;
+
+    // the range must not cross a chunk or buffer boundary
+    if (within % span + size > span || (within % span) % size)
+        return -EINVAL;
+
+    ptr = (char*)opaque->chunks[within/span].ptr + within % span;
+
+    // coherent chunks behind an IOMMU are vmap()ed pages, not linear memory
+    if (is_vmalloc_addr(ptr))
+    {
+        if (size > PAGE_SIZE)
+            return -EINVAL;
+        *pfn = vmalloc_to_pfn(ptr);
+        return 0;
+    }
+
+    *pfn = virt_to_phys(ptr) >> PAGE_SHIFT;
+
+    return 0;
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+static vm_fault_t dragon_vm_huge_fault(struct vm_fault *vmf,
+                                       enum page_entry_size pe_size)
+{
+    dragon_private *private = vmf->vma->vm_private_data;
+    unsigned long address = vmf->address & PMD_MASK;
+    unsigned long pgoff, pfn;
+    vm_fault_t ret = VM_FAULT_FALLBACK;
+
+    if (pe_size != PE_SIZE_PMD ||
+        address < vmf->vma->vm_start || address + PMD_SIZE > vmf->vma->vm_end)
+        return VM_FAULT_FALLBACK;
+
+    pgoff = vmf->vma->vm_pgoff + ((address - vmf->vma->vm_start) >> PAGE_SHIFT);
+
+    // anything else falls back to dragon_vm_fault() page by page
+    mutex_lock(&private->map_lock);
+    if (!dragon_mmap_lookup(private, pgoff, PMD_SIZE, &pfn) &&
+        !(pfn & ((PMD_SIZE >> PAGE_SHIFT) - 1)))
+    {
+        ret = vmf_insert_pfn_pmd(vmf, pfn_to_pfn_t(pfn),
+                                 vmf->flags & FAULT_FLAG_WRITE);
     }
+    mutex_unlock(&private->map_lock);
+
+    return ret;
+}
+#endif
+
+static vm_fault_t dragon_vm_fault(struct vm_fault *vmf)
+{
+    dragon_private *private = vmf->vma->vm_private_data;
+    unsigned long pfn;
+    vm_fault_t ret = VM_FAULT_SIGBUS;
+
+    mutex_lock(&private->map_lock);
+    if (!dragon_mmap_lookup(private, vmf->pgoff, PAGE_SIZE, &pfn))
+        ret = vmf_insert_pfn(vmf->vma, vmf->address, pfn);
+    mutex_unlock(&private->map_lock);
 
     return ret;
 }
 
+static const struct vm_operations_struct dragon_vm_ops = {
+    .fault = dragon_vm_fault,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    .huge_fault = dragon_vm_huge_fault,
+#endif
+};
+
 static int dragon_mmap(struct file *file, struct vm_area_struct *vma)
 {
-    vma->vm_flags |= VM_IO;
+    dragon_private *private = file->private_data;
 
-    if ( io_remap_pfn_range(vma, vma->vm_start, vma->vm_pgoff,
-                            vma->vm_end - vma->vm_start,
-                            vma->vm_page_prot) )
-        return -EAGAIN;
+    if (vma->vm_pgoff == (DRAGON_RING_MMAP_OFFSET >> PAGE_SHIFT))
+    {
+        if (vma->vm_end - vma->vm_start > PAGE_SIZE)
+            return -EINVAL;
+
+        vma->vm_flags |= VM_IO;
+
+        if ( remap_pfn_range(vma, vma->vm_start,
+                             virt_to_phys(private->ring) >> PAGE_SHIFT,
+                             vma->vm_end - vma->vm_start,
+                             vma->vm_page_prot) )
+            return -EAGAIN;
+
+        return 0;
+    }
+
+    if ((vma->vm_pgoff << PAGE_SHIFT) + (vma->vm_end - vma->vm_start) >
+        DRAGON_RING_MMAP_OFFSET)
+        return -EINVAL;
+
+    // private mappings would get COW copies of the DMA pages on write
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+
+    private->mapping = file->f_mapping;
+
+    vma->vm_flags |= VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP;
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    // lets huge_fault run with THP in madvise mode too
+    vma->vm_flags |= VM_HUGEPAGE;
+#endif
+    vma->vm_ops = &dragon_vm_ops;
+    vma->vm_private_data = private;
 
     return 0;
 }
@@ -848,26 +3043,156 @@ static const struct file_operations dragon_fops = {
     .release          =  dragon_release,
     .poll             =  dragon_poll,
     .mmap             =  dragon_mmap,
+    .get_unmapped_area = thp_get_unmapped_area,
+    .read_iter        =  dragon_read_iter,
+    .splice_read      =  dragon_splice_read,
     .unlocked_ioctl   =  dragon_ioctl,
+    .uring_cmd        =  dragon_uring,
 };
 
-static int probe(struct pci_dev *dev, const struct pci_device_id *id)
+static int dragon_stats_show(struct seq_file *m, void *v)
 {
-    dev_t cdev_no;
-    struct dragon_private *private = 0;
-    unsigned long mmio_length;
+    dragon_private *private = m->private;
+    dragon_stats *stats = &private->stats;
+
+    seq_printf(m, "irqs:              %lld\n", (long long)atomic64_read(&stats->irqs));
+    seq_printf(m, "buffers_completed: %lld\n", (long long)atomic64_read(&stats->completed));
+    seq_printf(m, "underruns:         %lld\n", (long long)atomic64_read(&stats->underruns));
+    seq_printf(m, "overwrites:        %lld\n", (long long)atomic64_read(&stats->overwrites));
+    seq_printf(m, "queue_length:      %d\n", atomic_read(&private->queue_length));
+    seq_printf(m, "peak_queue_length: %u\n", stats->peak_queue_length);
+    seq_printf(m, "dqueue_depth:      %u\n", dragon_index_ring_count(&private->dqring));
+    seq_printf(m, "dqbuf_eagain:      %lld\n", (long long)atomic64_read(&stats->dqbuf_eagain));
+    seq_printf(m, "sync_cpu_count:    %lld\n", (long long)atomic64_read(&stats->sync_cpu_count));
+    seq_printf(m, "sync_cpu_ns:       %lld\n", (long long)atomic64_read(&stats->sync_cpu_ns));
 
-    private = vmalloc_32(sizeof(struct dragon_private));
-    if (!private)
+    return 0;
+}
+
+static int dragon_latency_show(struct seq_file *m, void *v)
+{
+    dragon_private *private = m->private;
+    int i;
+
+    seq_printf(m, "# IRQ-to-DQBUF latency, us\n");
+    for (i = 0; i < DRAGON_LATENCY_BUCKETS; i++)
     {
-        pci_set_drvdata(dev, 0);
-        printk(KERN_INFO "vmalloc_32() failed\n");
-        goto err_alloc;
+        seq_printf(m, "< %10lu: %lld\n", 1UL << i,
+                   (long long)atomic64_read(&private->stats.latency[i]));
     }
-    memset(private, 0, sizeof(struct dragon_private));
 
-    private->pci_dev = dev;
-    pci_set_drvdata(dev, private);
+    return 0;
+}
+
+static int dragon_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, dragon_stats_show, inode->i_private);
+}
+
+static int dragon_latency_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, dragon_latency_show, inode->i_private);
+}
+
+static const struct file_operations dragon_stats_fops = {
+    .owner            =  THIS_MODULE,
+    .open             =  dragon_stats_open,
+    .read             =  seq_read,
+    .llseek           =  seq_lseek,
+    .release          =  single_release,
+};
+
+static const struct file_operations dragon_latency_fops = {
+    .owner            =  THIS_MODULE,
+    .open             =  dragon_latency_open,
+    .read             =  seq_read,
+    .llseek           =  seq_lseek,
+    .release          =  single_release,
+};
+
+#define DRAGON_STAT_ATTR(name, expr)                                    \
+static ssize_t name##_show(struct device *dev,                          \
+                           struct device_attribute *attr, char *buf)    \
+{                                                                       \
+    dragon_private *private = dev_get_drvdata(dev);                     \
+    return sprintf(buf, "%lld\n", (long long)(expr));                  \
+}                                                                       \
+static DEVICE_ATTR_RO(name)
+
+DRAGON_STAT_ATTR(irqs, atomic64_read(&private->stats.irqs));
+DRAGON_STAT_ATTR(buffers_completed, atomic64_read(&private->stats.completed));
+DRAGON_STAT_ATTR(underruns, atomic64_read(&private->stats.underruns));
+DRAGON_STAT_ATTR(overwrites, atomic64_read(&private->stats.overwrites));
+DRAGON_STAT_ATTR(queue_length, atomic_read(&private->queue_length));
+DRAGON_STAT_ATTR(peak_queue_length, private->stats.peak_queue_length);
+DRAGON_STAT_ATTR(dqueue_depth, dragon_index_ring_count(&private->dqring));
+DRAGON_STAT_ATTR(dqbuf_eagain, atomic64_read(&private->stats.dqbuf_eagain));
+DRAGON_STAT_ATTR(sync_cpu_ns, atomic64_read(&private->stats.sync_cpu_ns));
+
+static struct attribute *dragon_stats_attrs[] = {
+    &dev_attr_irqs.attr,
+    &dev_attr_buffers_completed.attr,
+    &dev_attr_underruns.attr,
+    &dev_attr_overwrites.attr,
+    &dev_attr_queue_length.attr,
+    &dev_attr_peak_queue_length.attr,
+    &dev_attr_dqueue_depth.attr,
+    &dev_attr_dqbuf_eagain.attr,
+    &dev_attr_sync_cpu_ns.attr,
+    NULL,
+};
+
+static const struct attribute_group dragon_stats_group = {
+    .name  = "stats",
+    .attrs = dragon_stats_attrs,
+};
+
+// where consumers should run and allocate to be local to the board
+static ssize_t numa_node_show(struct device *dev,
+                              struct device_attribute *attr, char *buf)
+{
+    dragon_private *private = dev_get_drvdata(dev);
+    return sprintf(buf, "%d\n", private->dev_node);
+}
+static DEVICE_ATTR_RO(numa_node);
+
+// where the buffer pages actually are, -1 if on several nodes or none
+static ssize_t buffer_node_show(struct device *dev,
+                                struct device_attribute *attr, char *buf)
+{
+    dragon_private *private = dev_get_drvdata(dev);
+    return sprintf(buf, "%d\n", private->buffers ? private->buf_mem_node : NUMA_NO_NODE);
+}
+static DEVICE_ATTR_RO(buffer_node);
+
+static ssize_t local_cpulist_show(struct device *dev,
+                                  struct device_attribute *attr, char *buf)
+{
+    dragon_private *private = dev_get_drvdata(dev);
+    return cpumap_print_to_pagebuf(true, buf, dragon_local_cpus(private));
+}
+static DEVICE_ATTR_RO(local_cpulist);
+
+static struct attribute *dragon_attrs[] = {
+    &dev_attr_numa_node.attr,
+    &dev_attr_buffer_node.attr,
+    &dev_attr_local_cpulist.attr,
+    NULL,
+};
+
+static const struct attribute_group dragon_group = {
+    .attrs = dragon_attrs,
+};
+
+static const struct attribute_group *dragon_attr_groups[] = {
+    &dragon_group,
+    &dragon_stats_group,
+    NULL,
+};
+
+static int dragon_add_cdev(dragon_private *private)
+{
+    dev_t cdev_no;
 
     //FIXME: Reimplement with atomic counter (CAS operation)
     spin_lock(&dev_number_lock);
@@ -876,23 +3201,88 @@ static int probe(struct pci_dev *dev, const struct pci_device_id *id)
 
     private->cdev_no = cdev_no;
 
+    //Init wait queue head and locks once, before the device can be opened
+    init_waitqueue_head(&private->wait);
+    spin_lock_init(&private->submit_lock);
+    spin_lock_init(&private->dequeue_lock);
+    spin_lock_init(&private->page_table_lock);
+    spin_lock_init(&private->eventfd_lock);
+    spin_lock_init(&private->uring_lock);
+    INIT_LIST_HEAD(&private->uring_cmds);
+    INIT_DELAYED_WORK(&private->uring_timeout, dragon_uring_timeout);
+    mutex_init(&private->activity_lock);
+    mutex_init(&private->read_lock);
+    mutex_init(&private->map_lock);
+    mutex_init(&private->requeue_lock);
+    mutex_init(&private->reconfig_lock);
+    hrtimer_init(&private->wake_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    private->wake_timer.function = dragon_wake_timer;
+
     cdev_init(&private->cdev, &dragon_fops);
     private->cdev.owner = THIS_MODULE;
 
     if ( cdev_add(&private->cdev, private->cdev_no, 1) )
     {
         printk(KERN_INFO "cdev_add() failed\n");
-        goto err_cdev_add;
+        return -1;
     }
 
     snprintf(private->dev_name, sizeof(private->dev_name),
              "dragon%d", MINOR(private->cdev_no));
 
-    if ( IS_ERR(device_create(dragon_class, NULL, private->cdev_no, NULL,
-                              private->dev_name)) )
+    if ( IS_ERR(device_create_with_groups(dragon_class, NULL, private->cdev_no,
+                                          private, dragon_attr_groups,
+                                          private->dev_name)) )
     {
         printk(KERN_INFO "device_create() failed\n");
-        goto err_device_create;
+        cdev_del(&private->cdev);
+        return -1;
+    }
+
+    if (dragon_debugfs_root)
+    {
+        private->debugfs_dir = debugfs_create_dir(private->dev_name,
+                                                  dragon_debugfs_root);
+        debugfs_create_file("stats", S_IRUGO, private->debugfs_dir,
+                            private, &dragon_stats_fops);
+        debugfs_create_file("latency_histogram", S_IRUGO, private->debugfs_dir,
+                            private, &dragon_latency_fops);
+    }
+
+    return 0;
+}
+
+static void dragon_del_cdev(dragon_private *private)
+{
+    debugfs_remove_recursive(private->debugfs_dir);
+    private->debugfs_dir = 0;
+
+    device_destroy(dragon_class, private->cdev_no);
+
+    cdev_del(&private->cdev);
+}
+
+static int probe(struct pci_dev *dev, const struct pci_device_id *id)
+{
+    struct dragon_private *private = 0;
+    unsigned long mmio_length;
+
+    private = vmalloc_32(sizeof(struct dragon_private));
+    if (!private)
+    {
+        pci_set_drvdata(dev, 0);
+        printk(KERN_INFO "vmalloc_32() failed\n");
+        goto err_alloc;
+    }
+    memset(private, 0, sizeof(struct dragon_private));
+
+    private->pci_dev = dev;
+    private->dev_node = dev_to_node(&dev->dev);
+    pci_set_drvdata(dev, private);
+
+    if ( dragon_add_cdev(private) )
+    {
+        goto err_add_cdev;
     }
 
     if ( pci_enable_device(private->pci_dev) )
@@ -909,9 +3299,9 @@ static int probe(struct pci_dev *dev, const struct pci_device_id *id)
 
     pci_set_master(private->pci_dev);
 
-    if ( pci_set_dma_mask(dev, DMA_BIT_MASK(64)) )
+    if ( dma_set_mask(&dev->dev, DMA_BIT_MASK(64)) )
     {
-        printk(KERN_INFO "pci_set_dma_mask() 64-bit failed\n");
+        printk(KERN_INFO "dma_set_mask() 64-bit failed\n");
         goto err_pci_set_dma_mask;
     }
 
@@ -930,6 +3320,8 @@ static int probe(struct pci_dev *dev, const struct pci_device_id *id)
         goto err_pci_iomap;
     }
 
+    dragon_pool_create(private);
+
     //set device availability flag
     atomic_set(&private->dev_available, 1);
 
@@ -946,10 +3338,8 @@ err_pci_set_dma_mask:
 err_pci_enable_msi:
     pci_disable_device(private->pci_dev);
 err_pci_enable_device:
-    device_destroy(dragon_class, private->cdev_no);
-err_device_create:
-    cdev_del(&private->cdev);
-err_cdev_add:
+    dragon_del_cdev(private);
+err_add_cdev:
     vfree(private);
 err_alloc:
     pci_set_drvdata(dev, 0);
@@ -965,6 +3355,8 @@ static void remove(struct pci_dev *dev)
 
     cdev_no = MINOR(private->cdev_no);
 
+    dragon_pool_destroy(private);
+
     pci_release_region(dev, 0);
 
     pci_disable_msi(dev);
@@ -973,9 +3365,7 @@ static void remove(struct pci_dev *dev)
 
     pci_disable_device(dev);
 
-    device_destroy(dragon_class, private->cdev_no);
-
-    cdev_del(&private->cdev);
+    dragon_del_cdev(private);
 
     vfree(private);
 
@@ -991,8 +3381,89 @@ static struct pci_driver dragon_driver = {
 };
 
 
+static dragon_private *dragon_emu_devices[DRAGON_EMU_MAXNUM_DEVS];
+
+static int dragon_emu_probe(unsigned int n)
+{
+    struct dragon_private *private = 0;
+    dragon_emu *emu;
+
+    private = vmalloc_32(sizeof(struct dragon_private));
+    if (!private)
+    {
+        printk(KERN_INFO "vmalloc_32() failed\n");
+        goto err_alloc;
+    }
+    memset(private, 0, sizeof(struct dragon_private));
+
+    emu = kzalloc(sizeof(dragon_emu), GFP_KERNEL);
+    if (!emu)
+    {
+        printk(KERN_INFO "emulator allocation failed\n");
+        goto err_alloc_emu;
+    }
+
+    spin_lock_init(&emu->lock);
+    hrtimer_init(&emu->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    emu->timer.function = dragon_emu_timer;
+    INIT_WORK(&emu->irq_work, dragon_emu_irq_work);
+    emu->private = private;
+    private->emu = emu;
+    private->dev_node = NUMA_NO_NODE;
+
+    if ( dragon_add_cdev(private) )
+    {
+        goto err_add_cdev;
+    }
+
+    dragon_pool_create(private);
+
+    //set device availability flag
+    atomic_set(&private->dev_available, 1);
+
+    dragon_emu_devices[n] = private;
+
+    printk(KERN_INFO "probe emulated dragon device %d complete\n", MINOR(private->cdev_no));
+
+    return 0;
+
+err_add_cdev:
+    kfree(emu);
+err_alloc_emu:
+    vfree(private);
+err_alloc:
+    return -1;
+}
+
+static void dragon_emu_remove(unsigned int n)
+{
+    unsigned cdev_no;
+    struct dragon_private *private = dragon_emu_devices[n];
+
+    if (!private) return;
+
+    cdev_no = MINOR(private->cdev_no);
+
+    hrtimer_cancel(&private->emu->timer);
+    cancel_work_sync(&private->emu->irq_work);
+
+    dragon_pool_destroy(private);
+
+    dragon_del_cdev(private);
+
+    kfree(private->emu);
+
+    vfree(private);
+
+    dragon_emu_devices[n] = 0;
+
+    printk(KERN_INFO "remove emulated dragon device %d complete\n", cdev_no);
+}
+
 static int dragon_init(void)
 {
+    unsigned int i;
+
     printk(KERN_INFO "dragon module init\n");
 
     /* Request dynamic allocation of a device major number */
@@ -1008,13 +3479,41 @@ static int dragon_init(void)
         return -1;
     }
 
+    // statistics are optional, the driver works without debugfs
+    dragon_debugfs_root = debugfs_create_dir(DRV_NAME, NULL);
+    if (IS_ERR(dragon_debugfs_root))
+    {
+        dragon_debugfs_root = 0;
+    }
+
+    if (dragon_emulate > DRAGON_EMU_MAXNUM_DEVS)
+    {
+        printk(KERN_INFO "too many emulated dragon devices, using %d\n",
+               DRAGON_EMU_MAXNUM_DEVS);
+        dragon_emulate = DRAGON_EMU_MAXNUM_DEVS;
+    }
+
+    for (i = 0; i < dragon_emulate; i++)
+    {
+        dragon_emu_probe(i);
+    }
+
     return pci_register_driver(&dragon_driver);
 }
 
 static void dragon_exit(void)
 {
+    unsigned int i;
+
     pci_unregister_driver(&dragon_driver);
 
+    for (i = 0; i < DRAGON_EMU_MAXNUM_DEVS; i++)
+    {
+        dragon_emu_remove(i);
+    }
+
+    debugfs_remove_recursive(dragon_debugfs_root);
+
     class_destroy(dragon_class);
 
     unregister_chrdev_region(MAJOR(dragon_dev_number), DRAGON_MAXNUM_DEVS);
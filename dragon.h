@@ -7,6 +7,8 @@
 #define DRAGON_PACKET_SIZE_BYTES  (DRAGON_PACKET_SIZE_DWORDS*4)
 
 #define DRAGON_DATA_PER_PACKET 120
+// service bytes preceding the one-byte samples in every packet
+#define DRAGON_PACKET_HEADER_BYTES (DRAGON_PACKET_SIZE_BYTES - DRAGON_DATA_PER_PACKET)
 #define DRAGON_MIN_FRAME_LENGTH DRAGON_DATA_PER_PACKET
 #define DRAGON_MAX_FRAME_LENGTH 65520
 #define DRAGON_MAX_FRAMES_PER_BUFFER 32768
@@ -16,13 +18,20 @@
 // maximum buffers count in FIFO
 #define DRAGON_MAX_BUFFER_COUNT 512
 
+// buffers bigger than one device transfer (DRAGON_MAX_FRAMES_PER_BUFFER
+// packets) are split into up to this many equal transfers ("chunks");
+// each chunk takes a FIFO slot, so fewer such buffers can be requested
+#define DRAGON_MAX_CHUNKS_PER_BUFFER 16
+
 
 typedef struct dragon_params
 {
     uint32_t frame_length;  // in ticks, 120 to 65520,
                             // must be multiple of 120 or will be rounded up
-    uint32_t frames_per_buffer; // count of frames in one buffer, 1 to 32768,
-                                // (frame_length*frames_per_buffer) must be less or equal 65520*60
+    uint32_t frames_per_buffer; // count of frames in one buffer, 1 to 32768*16,
+                                // (frame_length*frames_per_buffer) must be less or equal 32768*120*16;
+                                // buffers over 32768*120 are split in equal chunks of whole
+                                // frames, each a multiple of the page size in packet bytes
     //uint32_t switch_period;  // frames, 1 to 2^24, must be multiple of frames_per_buffer
                              // or will be rounded up
     //uint32_t switch_auto;    // 1 - auto (switch_period), 0 - manual
@@ -43,9 +52,97 @@ typedef struct dragon_buffer
     size_t idx;
     void*  ptr;
     size_t len;
-    off_t  offset;
+    off_t  offset;          // mmap() offset; buffers are laid out back to back,
+                            // so one mmap() from 0 can cover all of them
+    uint64_t sequence;      // completion number since activity was enabled
+    uint64_t queued_ns;     // CLOCK_MONOTONIC ns of QBUF
+    uint64_t completed_ns;  // CLOCK_MONOTONIC ns of the completion interrupt
+    uint32_t flags;         // DRAGON_BUFFER_* flags
+    int32_t timeout_ms;     // DQBUF: wait for a buffer this long, 0 - don't
+                            // wait, negative - forever; ignored with O_NONBLOCK
 } dragon_buffer;
 
+// dragon_buffer as it was before sequence, timestamps, flags and timeout_ms;
+// programs built with it use the _V1 ioctls, whose DQBUF never waits
+typedef struct dragon_buffer_v1
+{
+    size_t idx;
+    void*  ptr;
+    size_t len;
+    off_t  offset;
+} dragon_buffer_v1;
+
+// device queue was empty when the buffer was queued, so data preceding
+// it may have been lost
+#define DRAGON_BUFFER_UNDERRUN 1
+
+// array of buffers for DRAGON_QBUF_MULTI and DRAGON_DQBUF_MULTI
+typedef struct dragon_buffer_multi
+{
+    dragon_buffer* buffers;
+    uint32_t count;         // 1 to DRAGON_MAX_BUFFER_COUNT; on DQBUF_MULTI
+                            // return - number of dequeued buffers, at most
+                            // 64 per call
+    int32_t timeout_ms;     // DQBUF_MULTI: as in dragon_buffer
+} dragon_buffer_multi;
+
+// command area of an IORING_OP_URING_CMD submission, whose cmd_op is
+// DRAGON_QBUF_MULTI or DRAGON_DQBUF_MULTI; the result is 0 for QBUF_MULTI
+// and the number of dequeued buffers for DQBUF_MULTI
+typedef struct dragon_uring_cmd
+{
+    uint64_t multi;         // address of the dragon_buffer_multi
+    uint64_t reserved;      // must be 0
+} dragon_uring_cmd;
+
+// argument of DRAGON_REQUEST_BUFFERS_EX
+typedef struct dragon_request
+{
+    size_t count;           // as for DRAGON_REQUEST_BUFFERS: on return -
+                            // number of allocated buffers
+    uint32_t flags;         // DRAGON_REQUEST_* flags
+    int32_t node;           // NUMA node with DRAGON_REQUEST_NODE, otherwise
+                            // buffers go to the board's node; on return -
+                            // node the buffers are on, -1 if several
+} dragon_request;
+
+// allocate coherent DMA memory: no cache syncs on QBUF/DQBUF, but reads
+// may be slower on platforms where coherent memory is uncached
+#define DRAGON_REQUEST_COHERENT 1
+// allocate on dragon_request.node or fail
+#define DRAGON_REQUEST_NODE 2
+
+// Shared completion ring, enabled by DRAGON_SET_RING and mapped with
+// mmap(..., DRAGON_RING_MMAP_OFFSET). Heads and tails are free-running,
+// entries are buffer indices at [index & (DRAGON_RING_SIZE - 1)].
+// done:    kernel produces completed buffers at done_head,
+//          userspace consumes them and advances done_tail
+// requeue: userspace produces buffers to queue at requeue_head,
+//          kernel consumes them on every completion and on poll()
+// If flags has DRAGON_RING_NEED_KICK the device ran dry and userspace has
+// to call poll() after filling the requeue ring. DRAGON_RING_REJECTED stays
+// set until the next DRAGON_SET_RING once a requeue entry was out of range or
+// named a buffer the driver still held (queued twice, never dequeued).
+#define DRAGON_RING_SIZE DRAGON_MAX_BUFFER_COUNT
+#define DRAGON_RING_MMAP_OFFSET 0xFFFFF000 // above any buffer offset
+#define DRAGON_RING_NEED_KICK 1
+#define DRAGON_RING_REJECTED 2
+
+typedef struct dragon_ring
+{
+    uint32_t done_head;
+    uint32_t pad0[15];
+    uint32_t done_tail;
+    uint32_t pad1[15];
+    uint32_t requeue_head;
+    uint32_t pad2[15];
+    uint32_t requeue_tail;
+    uint32_t flags;
+    uint32_t pad3[14];
+    uint16_t done[DRAGON_RING_SIZE];
+    uint16_t requeue[DRAGON_RING_SIZE];
+} dragon_ring;
+
 
 #define DRAGON_SET_ACTIVITY         _IOW( 'D', 0, int)
 #define DRAGON_SET_DAC              _IOW( 'D', 1, int)
@@ -53,9 +150,21 @@ typedef struct dragon_buffer
 #define DRAGON_SET_PARAMS           _IOWR('D', 3, dragon_params*)
 #define DRAGON_REQUEST_BUFFERS      _IOWR('D', 4, size_t*)
 #define DRAGON_RELEASE_BUFFERS      _IOWR('D', 5, void*)
-#define DRAGON_QUERY_BUFFER         _IOWR('D', 6, dragon_buffer*)
-#define DRAGON_QBUF                 _IOWR('D', 7, dragon_buffer*)
-#define DRAGON_DQBUF                _IOWR('D', 8, dragon_buffer*)
+#define DRAGON_QUERY_BUFFER_V1      _IOWR('D', 6, dragon_buffer_v1*)
+#define DRAGON_QBUF_V1              _IOWR('D', 7, dragon_buffer_v1*)
+#define DRAGON_DQBUF_V1             _IOWR('D', 8, dragon_buffer_v1*)
 #define DRAGON_GET_ID               _IOWR('D', 9, uint32_t*)
+// 10 and 11 were QBUF_MULTI and DQBUF_MULTI with dragon_buffer_v1 entries
+#define DRAGON_SET_RING             _IOW( 'D', 12, int)
+#define DRAGON_REQUEST_BUFFERS_EX   _IOWR('D', 13, dragon_request*)
+#define DRAGON_SET_OVERWRITE        _IOW( 'D', 14, int)
+#define DRAGON_RECONFIGURE          _IOWR('D', 15, dragon_params*)
+#define DRAGON_SET_EVENTFD          _IOW( 'D', 16, int)
+// renumbered when dragon_buffer grew; the numbers encode the struct sizes
+#define DRAGON_QUERY_BUFFER         _IOWR('D', 17, dragon_buffer)
+#define DRAGON_QBUF                 _IOWR('D', 18, dragon_buffer)
+#define DRAGON_DQBUF                _IOWR('D', 19, dragon_buffer)
+#define DRAGON_QBUF_MULTI           _IOWR('D', 20, dragon_buffer_multi)
+#define DRAGON_DQBUF_MULTI          _IOWR('D', 21, dragon_buffer_multi)
 
 #endif //DRAGON_DEFINITIONS_HEADER
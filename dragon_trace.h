@@ -0,0 +1,176 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM dragon
+
+#if !defined(DRAGON_TRACE_HEADER) || defined(TRACE_HEADER_MULTI_READ)
+#define DRAGON_TRACE_HEADER
+
+#include <linux/tracepoint.h>
+
+// buffer moving through the queue: QBUF, completion, DQBUF
+DECLARE_EVENT_CLASS(dragon_buffer_class,
+
+    TP_PROTO(unsigned int minor, size_t idx, dma_addr_t dma_handle,
+             int queue_length, uint64_t sequence),
+
+    TP_ARGS(minor, idx, dma_handle, queue_length, sequence),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(size_t,       idx)
+        __field(u64,          dma_handle)
+        __field(int,          queue_length)
+        __field(u64,          sequence)
+    ),
+
+    TP_fast_assign(
+        __entry->minor        = minor;
+        __entry->idx          = idx;
+        __entry->dma_handle   = dma_handle;
+        __entry->queue_length = queue_length;
+        __entry->sequence     = sequence;
+    ),
+
+    TP_printk("dragon%u idx=%zu dma_handle=%llx queue_length=%d sequence=%llu",
+              __entry->minor, __entry->idx,
+              (unsigned long long)__entry->dma_handle,
+              __entry->queue_length,
+              (unsigned long long)__entry->sequence)
+);
+
+DEFINE_EVENT(dragon_buffer_class, dragon_qbuf,
+    TP_PROTO(unsigned int minor, size_t idx, dma_addr_t dma_handle,
+             int queue_length, uint64_t sequence),
+    TP_ARGS(minor, idx, dma_handle, queue_length, sequence)
+);
+
+DEFINE_EVENT(dragon_buffer_class, dragon_switch_one_buffer,
+    TP_PROTO(unsigned int minor, size_t idx, dma_addr_t dma_handle,
+             int queue_length, uint64_t sequence),
+    TP_ARGS(minor, idx, dma_handle, queue_length, sequence)
+);
+
+DEFINE_EVENT(dragon_buffer_class, dragon_dqbuf,
+    TP_PROTO(unsigned int minor, size_t idx, dma_addr_t dma_handle,
+             int queue_length, uint64_t sequence),
+    TP_ARGS(minor, idx, dma_handle, queue_length, sequence)
+);
+
+// streaming DMA sync of one buffer, emitted when the sync is done
+DECLARE_EVENT_CLASS(dragon_sync_class,
+
+    TP_PROTO(unsigned int minor, dma_addr_t dma_handle, size_t len,
+             uint64_t duration_ns),
+
+    TP_ARGS(minor, dma_handle, len, duration_ns),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(u64,          dma_handle)
+        __field(size_t,       len)
+        __field(u64,          duration_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->minor       = minor;
+        __entry->dma_handle  = dma_handle;
+        __entry->len         = len;
+        __entry->duration_ns = duration_ns;
+    ),
+
+    TP_printk("dragon%u dma_handle=%llx len=%zu duration_ns=%llu",
+              __entry->minor,
+              (unsigned long long)__entry->dma_handle,
+              __entry->len,
+              (unsigned long long)__entry->duration_ns)
+);
+
+DEFINE_EVENT(dragon_sync_class, dragon_sync_for_cpu,
+    TP_PROTO(unsigned int minor, dma_addr_t dma_handle, size_t len,
+             uint64_t duration_ns),
+    TP_ARGS(minor, dma_handle, len, duration_ns)
+);
+
+DEFINE_EVENT(dragon_sync_class, dragon_sync_for_device,
+    TP_PROTO(unsigned int minor, dma_addr_t dma_handle, size_t len,
+             uint64_t duration_ns),
+    TP_ARGS(minor, dma_handle, len, duration_ns)
+);
+
+TRACE_EVENT(dragon_irq_handler,
+
+    TP_PROTO(unsigned int minor, int irq_pending),
+
+    TP_ARGS(minor, irq_pending),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(int,          irq_pending)
+    ),
+
+    TP_fast_assign(
+        __entry->minor       = minor;
+        __entry->irq_pending = irq_pending;
+    ),
+
+    TP_printk("dragon%u irq_pending=%d",
+              __entry->minor, __entry->irq_pending)
+);
+
+// one pass of the threaded completion handler
+TRACE_EVENT(dragon_complete_buffers,
+
+    TP_PROTO(unsigned int minor, uint32_t addr, uint32_t irqs,
+             uint32_t queued, uint32_t completed),
+
+    TP_ARGS(minor, addr, irqs, queued, completed),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(uint32_t,     addr)
+        __field(uint32_t,     irqs)
+        __field(uint32_t,     queued)
+        __field(uint32_t,     completed)
+    ),
+
+    TP_fast_assign(
+        __entry->minor     = minor;
+        __entry->addr      = addr;
+        __entry->irqs      = irqs;
+        __entry->queued    = queued;
+        __entry->completed = completed;
+    ),
+
+    TP_printk("dragon%u addr=%08x irqs=%u queued=%u completed=%u",
+              __entry->minor, __entry->addr, __entry->irqs,
+              __entry->queued, __entry->completed)
+);
+
+TRACE_EVENT(dragon_set_activity,
+
+    TP_PROTO(unsigned int minor, int activity, int queue_length),
+
+    TP_ARGS(minor, activity, queue_length),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(int,          activity)
+        __field(int,          queue_length)
+    ),
+
+    TP_fast_assign(
+        __entry->minor        = minor;
+        __entry->activity     = activity;
+        __entry->queue_length = queue_length;
+    ),
+
+    TP_printk("dragon%u activity=%d queue_length=%d",
+              __entry->minor, __entry->activity, __entry->queue_length)
+);
+
+#endif //DRAGON_TRACE_HEADER
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE dragon_trace
+#include <trace/define_trace.h>
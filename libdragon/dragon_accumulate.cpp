@@ -0,0 +1,331 @@
+#include "dragon_accumulate.hpp"
+#include "dragon_cpu.hpp"
+
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DRAGON_X86 1
+#include <immintrin.h>
+#endif
+
+namespace dragon
+{
+
+static const size_t packet_bytes = DRAGON_PACKET_SIZE_BYTES;
+static const size_t header_bytes = DRAGON_PACKET_HEADER_BYTES;
+static const size_t samples = DRAGON_DATA_PER_PACKET;
+
+// 32-bit sums can't overflow within this many frames of 8-bit samples
+static const uint64_t fold_frames = 1 << 24;
+
+// packets summed over all frames of a job before moving on, so their sums
+// stay in L1 (32 packets - 15 KiB)
+static const size_t tile_packets = 32;
+
+// add `packets` packets of each of `frames` frames to sums
+typedef void (*accumulate_fn)(const uint8_t* p, size_t frames, size_t frame_bytes,
+                              size_t packets, uint32_t* sums);
+
+static void accumulate_scalar(const uint8_t* p, size_t frames, size_t frame_bytes,
+                              size_t packets, uint32_t* sums)
+{
+    size_t k, j;
+
+    for (; frames; frames--, p += frame_bytes)
+    {
+        const uint8_t* s = p + header_bytes;
+        uint32_t* d = sums;
+        for (k = 0; k < packets; k++, s += packet_bytes, d += samples)
+        {
+            for (j = 0; j < samples; j++)
+                d[j] += s[j];
+        }
+    }
+}
+
+#ifdef DRAGON_X86
+
+// Packets are summed 16 samples at a time; 120 samples leave a tail of 8.
+
+__attribute__((target("sse4.1")))
+static inline void add4_sse41(uint32_t* d, __m128i v)
+{
+    __m128i* a = (__m128i*)d;
+    _mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a), _mm_cvtepu8_epi32(v)));
+}
+
+__attribute__((target("sse4.1")))
+static void accumulate_sse41(const uint8_t* p, size_t frames, size_t frame_bytes,
+                             size_t packets, uint32_t* sums)
+{
+    size_t k, j;
+
+    for (; frames; frames--, p += frame_bytes)
+    {
+        const uint8_t* s = p + header_bytes;
+        uint32_t* d = sums;
+        for (k = 0; k < packets; k++, s += packet_bytes, d += samples)
+        {
+            for (j = 0; j + 16 <= samples; j += 16)
+            {
+                __m128i v = _mm_loadu_si128((const __m128i*)(s + j));
+                add4_sse41(d + j, v);
+                add4_sse41(d + j + 4, _mm_srli_si128(v, 4));
+                add4_sse41(d + j + 8, _mm_srli_si128(v, 8));
+                add4_sse41(d + j + 12, _mm_srli_si128(v, 12));
+            }
+            __m128i v = _mm_loadl_epi64((const __m128i*)(s + j));
+            add4_sse41(d + j, v);
+            add4_sse41(d + j + 4, _mm_srli_si128(v, 4));
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static inline void add8_avx2(uint32_t* d, __m128i v)
+{
+    __m256i* a = (__m256i*)d;
+    _mm256_storeu_si256(a, _mm256_add_epi32(_mm256_loadu_si256(a), _mm256_cvtepu8_epi32(v)));
+}
+
+__attribute__((target("avx2")))
+static void accumulate_avx2(const uint8_t* p, size_t frames, size_t frame_bytes,
+                            size_t packets, uint32_t* sums)
+{
+    size_t k, j;
+
+    for (; frames; frames--, p += frame_bytes)
+    {
+        const uint8_t* s = p + header_bytes;
+        uint32_t* d = sums;
+        for (k = 0; k < packets; k++, s += packet_bytes, d += samples)
+        {
+            for (j = 0; j + 16 <= samples; j += 16)
+            {
+                __m128i v = _mm_loadu_si128((const __m128i*)(s + j));
+                add8_avx2(d + j, v);
+                add8_avx2(d + j + 8, _mm_srli_si128(v, 8));
+            }
+            add8_avx2(d + j, _mm_loadl_epi64((const __m128i*)(s + j)));
+        }
+    }
+}
+
+// the all-ones mask avoids gcc 12 warning about its own _mm512_undefined
+__attribute__((target("avx512f,avx512bw")))
+static void accumulate_avx512(const uint8_t* p, size_t frames, size_t frame_bytes,
+                              size_t packets, uint32_t* sums)
+{
+    size_t k, j;
+
+    for (; frames; frames--, p += frame_bytes)
+    {
+        const uint8_t* s = p + header_bytes;
+        uint32_t* d = sums;
+        for (k = 0; k < packets; k++, s += packet_bytes, d += samples)
+        {
+            for (j = 0; j + 16 <= samples; j += 16)
+            {
+                __m128i v = _mm_loadu_si128((const __m128i*)(s + j));
+                __m512i a = _mm512_loadu_si512(d + j);
+                a = _mm512_add_epi32(a, _mm512_maskz_cvtepu8_epi32(0xFFFF, v));
+                _mm512_storeu_si512(d + j, a);
+            }
+            add8_avx2(d + j, _mm_loadl_epi64((const __m128i*)(s + j)));
+        }
+    }
+}
+
+#endif // DRAGON_X86
+
+// indexed by isa
+static const accumulate_fn accumulate_ops[] =
+{
+    accumulate_scalar,
+#ifdef DRAGON_X86
+    accumulate_sse41,
+    accumulate_avx2,
+    accumulate_avx512,
+#endif
+};
+
+static accumulate_fn active_accumulate()
+{
+    size_t i = static_cast<size_t>(active_isa());
+    size_t n = sizeof(accumulate_ops)/sizeof(accumulate_ops[0]);
+    return accumulate_ops[i < n ? i : 0];
+}
+
+accumulator::accumulator(uint32_t frame_length, uint64_t depth, sink on_average,
+                         unsigned threads)
+    : depth_(depth ? depth : 1), sink_(on_average),
+      frames_(0), since_fold_(0), averages_(0),
+      job_frames_(0), job_count_(0), job_stride_(0), job_fold_(false), job_finish_(false),
+      generation_(0), busy_(0), quit_(false)
+{
+    size_t i;
+
+    frame_packets_ = frame_length ? (frame_length - 1)/samples + 1 : 1;
+    frame_length_ = frame_packets_*samples;
+    frame_bytes_ = frame_packets_*packet_bytes;
+
+    sums_.assign(frame_length_, 0);
+    if (depth_ > fold_frames)
+        totals_.assign(frame_length_, 0);
+    average_.resize(frame_length_);
+
+    if (!threads)
+        threads = 1;
+    if (threads > frame_packets_)
+        threads = frame_packets_;
+    for (i = 0; i < threads; i++)
+    {
+        range r;
+        r.first = frame_packets_*i/threads;
+        r.count = frame_packets_*(i + 1)/threads - r.first;
+        ranges_.push_back(r);
+    }
+
+    // range 0 is summed by the caller
+    for (i = 1; i < threads; i++)
+        threads_.push_back(std::thread(&accumulator::worker, this, i));
+}
+
+accumulator::~accumulator()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        quit_ = true;
+    }
+    start_.notify_all();
+    for (size_t i = 0; i < threads_.size(); i++)
+        threads_[i].join();
+}
+
+void accumulator::reset()
+{
+    std::fill(sums_.begin(), sums_.end(), 0);
+    std::fill(totals_.begin(), totals_.end(), 0);
+    frames_ = 0;
+    since_fold_ = 0;
+}
+
+void accumulator::run(size_t r)
+{
+    const range& rg = ranges_[r];
+    accumulate_fn accumulate = active_accumulate();
+    size_t k, n, b;
+
+    for (k = rg.first; k < rg.first + rg.count; k += n)
+    {
+        n = std::min(tile_packets, rg.first + rg.count - k);
+        accumulate(job_frames_ + k*packet_bytes, job_count_, job_stride_, n,
+                   &sums_[k*samples]);
+    }
+
+    if (!job_fold_ && !job_finish_)
+        return;
+
+    for (b = rg.first*samples; b < (rg.first + rg.count)*samples; b++)
+    {
+        if (job_finish_)
+        {
+            uint64_t total = sums_[b];
+            if (!totals_.empty())
+            {
+                total += totals_[b];
+                totals_[b] = 0;
+            }
+            average_[b] = (float)((double)total/depth_);
+        }
+        else
+        {
+            totals_[b] += sums_[b];
+        }
+        sums_[b] = 0;
+    }
+}
+
+void accumulator::worker(size_t r)
+{
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> guard(lock_);
+
+    for (;;)
+    {
+        while (!quit_ && generation_ == seen)
+            start_.wait(guard);
+        if (quit_)
+            return;
+        seen = generation_;
+
+        guard.unlock();
+        run(r);
+        guard.lock();
+
+        if (!--busy_)
+            done_.notify_one();
+    }
+}
+
+void accumulator::dispatch()
+{
+    if (threads_.empty())
+    {
+        run(0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        busy_ = threads_.size();
+        generation_++;
+    }
+    start_.notify_all();
+
+    run(0);
+
+    std::unique_lock<std::mutex> guard(lock_);
+    while (busy_)
+        done_.wait(guard);
+}
+
+void accumulator::add(const uint8_t* packets, size_t bytes)
+{
+    add_frames(packets, bytes/frame_bytes_, frame_bytes_);
+}
+
+void accumulator::add_frames(const uint8_t* first, size_t left, size_t stride)
+{
+    while (left)
+    {
+        // a job ends where an average completes or the sums must be folded
+        uint64_t count = std::min<uint64_t>(left, depth_ - frames_);
+        count = std::min(count, fold_frames - since_fold_);
+
+        frames_ += count;
+        since_fold_ += count;
+        job_frames_ = first;
+        job_count_ = count;
+        job_stride_ = stride;
+        job_finish_ = frames_ == depth_;
+        job_fold_ = !job_finish_ && since_fold_ == fold_frames;
+
+        dispatch();
+
+        first += count*stride;
+        left -= count;
+        if (job_fold_)
+            since_fold_ = 0;
+        if (job_finish_)
+        {
+            frames_ = 0;
+            since_fold_ = 0;
+            averages_++;
+            if (sink_)
+                sink_(average_.data(), frame_length_);
+        }
+    }
+}
+
+} // namespace dragon
@@ -0,0 +1,104 @@
+// libdragon: averaging frames straight out of buffers
+//
+// accumulator sums every `depth` frames bin by bin and hands the average
+// trace to a sink. It reads the samples from the packets in place, so no
+// unpacked copy is made. Sums are kept in 32 bits and folded into 64-bit
+// totals only when the depth needs it. With more than one thread, each
+// thread owns a range of bins of every frame and the ranges are summed in
+// parallel.
+
+#ifndef DRAGON_ACCUMULATE_HPP
+#define DRAGON_ACCUMULATE_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "dragon_demux.hpp"
+#include "dragon_stream.hpp"
+
+namespace dragon
+{
+
+class accumulator
+{
+public:
+    // called with frame_length averaged bins every `depth` frames, from
+    // the thread calling add(); the data is valid until the call returns
+    typedef std::function<void(const float* average, size_t length)> sink;
+
+    // frame_length is rounded up to whole packets as the driver does;
+    // threads is the number of threads summing, the caller's included
+    accumulator(uint32_t frame_length, uint64_t depth, sink on_average,
+                unsigned threads = 1);
+    ~accumulator();
+
+    accumulator(const accumulator&) = delete;
+    accumulator& operator=(const accumulator&) = delete;
+
+    // sum the whole frames in `bytes` of buffer data
+    void add(const uint8_t* packets, size_t bytes);
+    void add(const lease& buf) { add(buf.data(), buf.size()); }
+    // sum the frames of one channel of a buffer
+    void add(const channel_view& view) { add_frames(view.first, view.frames, view.stride); }
+
+    // drop the frames summed towards the next average
+    void reset();
+
+    uint32_t frame_length() const { return frame_length_; }
+    uint64_t depth() const { return depth_; }
+    // frames summed towards the next average
+    uint64_t frames() const { return frames_; }
+    // averages emitted so far
+    uint64_t averages() const { return averages_; }
+
+private:
+    struct range
+    {
+        size_t first;   // first packet of the frame
+        size_t count;   // packets
+    };
+
+    void add_frames(const uint8_t* first, size_t frames, size_t stride);
+    void dispatch();
+    void run(size_t r);
+    void worker(size_t r);
+
+    uint32_t frame_length_;
+    size_t frame_packets_;
+    size_t frame_bytes_;
+    uint64_t depth_;
+    sink sink_;
+
+    uint64_t frames_;
+    uint64_t since_fold_;
+    uint64_t averages_;
+    std::vector<uint32_t> sums_;
+    std::vector<uint64_t> totals_;  // only for depths that overflow sums_
+    std::vector<float> average_;
+    std::vector<range> ranges_;
+
+    // current job, written by add() before a new generation starts
+    const uint8_t* job_frames_;
+    size_t job_count_;
+    size_t job_stride_;
+    bool job_fold_;
+    bool job_finish_;
+
+    std::vector<std::thread> threads_;
+    std::mutex lock_;
+    std::condition_variable start_;
+    std::condition_variable done_;
+    uint64_t generation_;
+    unsigned busy_;
+    bool quit_;
+};
+
+} // namespace dragon
+
+#endif // DRAGON_ACCUMULATE_HPP
@@ -0,0 +1,58 @@
+#include "dragon_cpu.hpp"
+
+#include <atomic>
+
+namespace dragon
+{
+
+static isa detect_isa()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    // also checks that the OS saves the wider registers
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        return isa::avx512;
+    if (__builtin_cpu_supports("avx2"))
+        return isa::avx2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return isa::sse41;
+#endif
+    return isa::scalar;
+}
+
+static std::atomic<int> selected_isa(-1);
+
+isa supported_isa()
+{
+    static const isa best = detect_isa();
+    return best;
+}
+
+isa active_isa()
+{
+    int i = selected_isa.load(std::memory_order_relaxed);
+    if (i < 0)
+        return supported_isa();
+    return static_cast<isa>(i);
+}
+
+isa set_isa(isa want)
+{
+    isa i = want < supported_isa() ? want : supported_isa();
+    selected_isa.store(static_cast<int>(i), std::memory_order_relaxed);
+    return i;
+}
+
+const char* isa_name(isa i)
+{
+    switch (i)
+    {
+    case isa::scalar: return "scalar";
+    case isa::sse41:  return "sse4.1";
+    case isa::avx2:   return "avx2";
+    case isa::avx512: return "avx512";
+    }
+    return "unknown";
+}
+
+} // namespace dragon
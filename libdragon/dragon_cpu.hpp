@@ -0,0 +1,34 @@
+// libdragon: instruction set selection for the data kernels
+//
+// Every kernel (unpack, accumulate, statistics) comes in plain C++ and in
+// SSE4.1, AVX2 and AVX-512 (F+BW) variants compiled side by side. The best
+// one the CPU and OS support is used unless a lower one is selected, which
+// is meant for benchmarks and for checking results against isa::scalar.
+
+#ifndef DRAGON_CPU_HPP
+#define DRAGON_CPU_HPP
+
+namespace dragon
+{
+
+enum class isa
+{
+    scalar = 0,
+    sse41,
+    avx2,
+    avx512,
+};
+
+// best instruction set this host runs
+isa supported_isa();
+// instruction set the kernels use now
+isa active_isa();
+// Use the given instruction set, or the best supported one below it;
+// returns the one selected. Affects all kernels, also those running.
+isa set_isa(isa want);
+
+const char* isa_name(isa i);
+
+} // namespace dragon
+
+#endif // DRAGON_CPU_HPP
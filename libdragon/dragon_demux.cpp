@@ -0,0 +1,49 @@
+#include "dragon_demux.hpp"
+
+namespace dragon
+{
+
+channel_demux::channel_demux(uint32_t frame_length, unsigned first_channel)
+    : first_channel_(first_channel & 1), phase_(first_channel & 1),
+      started_(false), in_sync_(true), last_sequence_(0)
+{
+    size_t packets = frame_length ? (frame_length - 1)/DRAGON_DATA_PER_PACKET + 1 : 1;
+    frame_bytes_ = packets*DRAGON_PACKET_SIZE_BYTES;
+}
+
+bool channel_demux::split(const uint8_t* data, size_t bytes, uint64_t sequence,
+                          channel_view views[2], uint32_t flags)
+{
+    uint64_t frames = bytes/frame_bytes_;
+    unsigned c;
+
+    // only the parity of the frames in between matters
+    if (!started_ || sequence <= last_sequence_)
+    {
+        phase_ = (first_channel_ + sequence*frames) & 1;
+        in_sync_ = true;
+    }
+    else
+        phase_ = (phase_ + (sequence - last_sequence_ - 1)*frames) & 1;
+    started_ = true;
+
+    // frames were dropped without a trace in the sequence
+    if (flags & DRAGON_BUFFER_UNDERRUN)
+        in_sync_ = false;
+    last_sequence_ = sequence;
+
+    for (c = 0; c < 2; c++)
+    {
+        // the phase channel gets the first frame and the odd one out
+        size_t skip = c == phase_ ? 0 : 1;
+        views[c].first = data + skip*frame_bytes_;
+        views[c].frames = frames > skip ? (frames - skip + 1)/2 : 0;
+        views[c].frame_bytes = frame_bytes_;
+        views[c].stride = 2*frame_bytes_;
+    }
+
+    phase_ ^= frames & 1;
+    return in_sync_;
+}
+
+} // namespace dragon
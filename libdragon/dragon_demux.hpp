@@ -0,0 +1,70 @@
+// libdragon: separating the channels of channel_auto acquisition
+//
+// With channel_auto the board samples ADC 0 and ADC 1 in alternate frames,
+// starting with ADC 0 after activity is enabled. channel_demux follows the
+// phase from buffer to buffer and describes the frames of each channel as
+// a strided view into the buffer, which accumulator and unpack() take
+// directly, so the channels are never copied apart.
+
+#ifndef DRAGON_DEMUX_HPP
+#define DRAGON_DEMUX_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dragon_stream.hpp"
+
+namespace dragon
+{
+
+// frames of one channel within a buffer
+struct channel_view
+{
+    const uint8_t* first;   // first packet of the first frame
+    size_t frames;
+    size_t frame_bytes;     // packet bytes of a frame
+    size_t stride;          // bytes from one frame of the channel to the next
+
+    const uint8_t* frame(size_t i) const { return first + i*stride; }
+};
+
+class channel_demux
+{
+public:
+    // frame_length is rounded up to whole packets as the driver does
+    explicit channel_demux(uint32_t frame_length, unsigned first_channel = 0);
+
+    // Split a buffer into views[0] and views[1]. Buffers must be passed in
+    // completion order; buffers missing from the sequence (overwritten) are
+    // taken to have been as long as this one, and a sequence going back
+    // means activity was enabled again. DRAGON_BUFFER_UNDERRUN in flags
+    // means the device dropped an unknown number of frames before the
+    // buffer, after which the channels can't be told apart: split() then
+    // returns false, for this and every later buffer until activity is
+    // enabled again or reset(), and the views only keep alternating.
+    bool split(const uint8_t* data, size_t bytes, uint64_t sequence,
+               channel_view views[2], uint32_t flags = 0);
+    bool split(const lease& buf, channel_view views[2])
+    {
+        return split(buf.data(), buf.size(), buf.sequence(), views, buf.flags());
+    }
+
+    // channel of the frame expected next
+    unsigned phase() const { return phase_; }
+    // false from an underrun until activity is enabled again or reset()
+    bool in_sync() const { return in_sync_; }
+    // start over as if activity was just enabled
+    void reset() { started_ = false; }
+
+private:
+    size_t frame_bytes_;
+    unsigned first_channel_;
+    unsigned phase_;
+    bool started_;
+    bool in_sync_;
+    uint64_t last_sequence_;
+};
+
+} // namespace dragon
+
+#endif // DRAGON_DEMUX_HPP
@@ -0,0 +1,564 @@
+#include "dragon_statistics.hpp"
+#include "dragon_cpu.hpp"
+
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DRAGON_X86 1
+#include <immintrin.h>
+#endif
+
+namespace dragon
+{
+
+static const size_t packet_bytes = DRAGON_PACKET_SIZE_BYTES;
+static const size_t header_bytes = DRAGON_PACKET_HEADER_BYTES;
+static const size_t samples = DRAGON_DATA_PER_PACKET;
+
+// 32-bit sums of squares of 8-bit samples can't overflow within a step
+static const uint32_t max_step = 65536;
+
+// packets processed over all frames of a job before moving on, so their
+// per-bin state stays in L1 (16 packets - 19 KiB)
+static const size_t tile_packets = 16;
+
+// add `packets` packets of each of `frames` frames to the sums, squares,
+// min and max of their bins
+typedef void (*moments_fn)(const uint8_t* p, size_t frames, size_t stride, size_t packets,
+                           uint32_t* sum, uint32_t* square, uint8_t* mn, uint8_t* mx);
+// the same for exponentially weighted mean and variance
+typedef void (*weighted_fn)(const uint8_t* p, size_t frames, size_t stride, size_t packets,
+                            float alpha, float* mean, float* variance, uint8_t* mn, uint8_t* mx);
+
+struct statistics_ops
+{
+    moments_fn moments;
+    weighted_fn weighted;
+};
+
+static void moments_scalar(const uint8_t* p, size_t frames, size_t stride, size_t packets,
+                           uint32_t* sum, uint32_t* square, uint8_t* mn, uint8_t* mx)
+{
+    size_t k, j, b;
+
+    for (; frames; frames--, p += stride)
+    {
+        const uint8_t* s = p + header_bytes;
+        for (k = 0, b = 0; k < packets; k++, s += packet_bytes)
+        {
+            for (j = 0; j < samples; j++, b++)
+            {
+                uint32_t x = s[j];
+                sum[b] += x;
+                square[b] += x*x;
+                mn[b] = std::min<uint8_t>(mn[b], x);
+                mx[b] = std::max<uint8_t>(mx[b], x);
+            }
+        }
+    }
+}
+
+static void weighted_scalar(const uint8_t* p, size_t frames, size_t stride, size_t packets,
+                            float alpha, float* mean, float* variance, uint8_t* mn, uint8_t* mx)
+{
+    size_t k, j, b;
+
+    for (; frames; frames--, p += stride)
+    {
+        const uint8_t* s = p + header_bytes;
+        for (k = 0, b = 0; k < packets; k++, s += packet_bytes)
+        {
+            for (j = 0; j < samples; j++, b++)
+            {
+                float d = s[j] - mean[b];
+                float step = alpha*d;
+                mean[b] += step;
+                variance[b] = (1 - alpha)*(variance[b] + d*step);
+                mn[b] = std::min(mn[b], s[j]);
+                mx[b] = std::max(mx[b], s[j]);
+            }
+        }
+    }
+}
+
+#ifdef DRAGON_X86
+
+__attribute__((target("sse4.1")))
+static inline void minmax_sse41(const uint8_t* s, uint8_t* mn, uint8_t* mx)
+{
+    size_t j;
+
+    for (j = 0; j + 16 <= samples; j += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + j));
+        __m128i* a = (__m128i*)(mn + j);
+        __m128i* b = (__m128i*)(mx + j);
+        _mm_storeu_si128(a, _mm_min_epu8(_mm_loadu_si128(a), v));
+        _mm_storeu_si128(b, _mm_max_epu8(_mm_loadu_si128(b), v));
+    }
+    __m128i v = _mm_loadl_epi64((const __m128i*)(s + j));
+    __m128i* a = (__m128i*)(mn + j);
+    __m128i* b = (__m128i*)(mx + j);
+    _mm_storel_epi64(a, _mm_min_epu8(_mm_loadl_epi64(a), v));
+    _mm_storel_epi64(b, _mm_max_epu8(_mm_loadl_epi64(b), v));
+}
+
+__attribute__((target("sse4.1")))
+static inline void add4_sse41(uint32_t* d, __m128i v)
+{
+    __m128i* a = (__m128i*)d;
+    _mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a), v));
+}
+
+// squares of 8-bit samples fit 16 bits, so they are taken before widening
+__attribute__((target("sse4.1")))
+static void moments_sse41(const uint8_t* p, size_t frames, size_t stride, size_t packets,
+                          uint32_t* sum, uint32_t* square, uint8_t* mn, uint8_t* mx)
+{
+    size_t k, j, b;
+
+    for (; frames; frames--, p += stride)
+    {
+        const uint8_t* s = p + header_bytes;
+        for (k = 0, b = 0; k < packets; k++, s += packet_bytes, b += samples)
+        {
+            for (j = 0; j < samples; j += 8)
+            {
+                __m128i x = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(s + j)));
+                __m128i x2 = _mm_mullo_epi16(x, x);
+                add4_sse41(sum + b + j, _mm_cvtepu16_epi32(x));
+                add4_sse41(sum + b + j + 4, _mm_cvtepu16_epi32(_mm_srli_si128(x, 8)));
+                add4_sse41(square + b + j, _mm_cvtepu16_epi32(x2));
+                add4_sse41(square + b + j + 4, _mm_cvtepu16_epi32(_mm_srli_si128(x2, 8)));
+            }
+            minmax_sse41(s, mn + b, mx + b);
+        }
+    }
+}
+
+__attribute__((target("sse4.1")))
+static void weighted_sse41(const uint8_t* p, size_t frames, size_t stride, size_t packets,
+                           float alpha, float* mean, float* variance, uint8_t* mn, uint8_t* mx)
+{
+    __m128 a = _mm_set1_ps(alpha);
+    __m128 keep = _mm_set1_ps(1 - alpha);
+    size_t k, j, b;
+
+    for (; frames; frames--, p += stride)
+    {
+        const uint8_t* s = p + header_bytes;
+        for (k = 0, b = 0; k < packets; k++, s += packet_bytes, b += samples)
+        {
+            for (j = 0; j < samples; j += 4)
+            {
+                int32_t word;
+                memcpy(&word, s + j, 4);
+                __m128 x = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(word)));
+                __m128 m = _mm_loadu_ps(mean + b + j);
+                __m128 d = _mm_sub_ps(x, m);
+                __m128 step = _mm_mul_ps(a, d);
+                __m128 v = _mm_add_ps(_mm_loadu_ps(variance + b + j), _mm_mul_ps(d, step));
+                _mm_storeu_ps(mean + b + j, _mm_add_ps(m, step));
+                _mm_storeu_ps(variance + b + j, _mm_mul_ps(keep, v));
+            }
+            minmax_sse41(s, mn + b, mx + b);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static inline void add8_avx2(uint32_t* d, __m128i v16)
+{
+    __m256i* a = (__m256i*)d;
+    _mm256_storeu_si256(a, _mm256_add_epi32(_mm256_loadu_si256(a), _mm256_cvtepu16_epi32(v16)));
+}
+
+__attribute__((target("avx2")))
+static inline void moments8_avx2(const uint8_t* s, uint32_t* sum, uint32_t* square)
+{
+    __m128i x = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)s));
+    add8_avx2(sum, x);
+    add8_avx2(square, _mm_mullo_epi16(x, x));
+}
+
+__attribute__((target("avx2")))
+static void moments_avx2(const uint8_t* p, size_t frames, size_t stride, size_t packets,
+                         uint32_t* sum, uint32_t* square, uint8_t* mn, uint8_t* mx)
+{
+    size_t k, j, b;
+
+    for (; frames; frames--, p += stride)
+    {
+        const uint8_t* s = p + header_bytes;
+        for (k = 0, b = 0; k < packets; k++, s += packet_bytes, b += samples)
+        {
+            for (j = 0; j + 16 <= samples; j += 16)
+            {
+                __m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(s + j)));
+                __m256i x2 = _mm256_mullo_epi16(x, x);
+                add8_avx2(sum + b + j, _mm256_castsi256_si128(x));
+                add8_avx2(sum + b + j + 8, _mm256_extracti128_si256(x, 1));
+                add8_avx2(square + b + j, _mm256_castsi256_si128(x2));
+                add8_avx2(square + b + j + 8, _mm256_extracti128_si256(x2, 1));
+            }
+            moments8_avx2(s + j, sum + b + j, square + b + j);
+            minmax_sse41(s, mn + b, mx + b);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void weighted_avx2(const uint8_t* p, size_t frames, size_t stride, size_t packets,
+                          float alpha, float* mean, float* variance, uint8_t* mn, uint8_t* mx)
+{
+    __m256 a = _mm256_set1_ps(alpha);
+    __m256 keep = _mm256_set1_ps(1 - alpha);
+    size_t k, j, b;
+
+    for (; frames; frames--, p += stride)
+    {
+        const uint8_t* s = p + header_bytes;
+        for (k = 0, b = 0; k < packets; k++, s += packet_bytes, b += samples)
+        {
+            for (j = 0; j < samples; j += 8)
+            {
+                __m128i v8 = _mm_loadl_epi64((const __m128i*)(s + j));
+                __m256 x = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v8));
+                __m256 m = _mm256_loadu_ps(mean + b + j);
+                __m256 d = _mm256_sub_ps(x, m);
+                __m256 step = _mm256_mul_ps(a, d);
+                __m256 v = _mm256_add_ps(_mm256_loadu_ps(variance + b + j), _mm256_mul_ps(d, step));
+                _mm256_storeu_ps(mean + b + j, _mm256_add_ps(m, step));
+                _mm256_storeu_ps(variance + b + j, _mm256_mul_ps(keep, v));
+            }
+            minmax_sse41(s, mn + b, mx + b);
+        }
+    }
+}
+
+// the all-ones masks avoid gcc 12 warning about its own _mm512_undefined
+__attribute__((target("avx512f,avx512bw")))
+static inline void add16_avx512(uint32_t* d, __m256i v16)
+{
+    __m512i a = _mm512_loadu_si512(d);
+    _mm512_storeu_si512(d, _mm512_add_epi32(a, _mm512_maskz_cvtepu16_epi32(0xFFFF, v16)));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void moments_avx512(const uint8_t* p, size_t frames, size_t stride, size_t packets,
+                           uint32_t* sum, uint32_t* square, uint8_t* mn, uint8_t* mx)
+{
+    size_t k, j, b;
+
+    for (; frames; frames--, p += stride)
+    {
+        const uint8_t* s = p + header_bytes;
+        for (k = 0, b = 0; k < packets; k++, s += packet_bytes, b += samples)
+        {
+            for (j = 0; j + 16 <= samples; j += 16)
+            {
+                __m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(s + j)));
+                add16_avx512(sum + b + j, x);
+                add16_avx512(square + b + j, _mm256_mullo_epi16(x, x));
+            }
+            moments8_avx2(s + j, sum + b + j, square + b + j);
+            minmax_sse41(s, mn + b, mx + b);
+        }
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void weighted_avx512(const uint8_t* p, size_t frames, size_t stride, size_t packets,
+                            float alpha, float* mean, float* variance, uint8_t* mn, uint8_t* mx)
+{
+    __m512 a = _mm512_set1_ps(alpha);
+    __m512 keep = _mm512_set1_ps(1 - alpha);
+    size_t k, j, b;
+
+    for (; frames; frames--, p += stride)
+    {
+        const uint8_t* s = p + header_bytes;
+        for (k = 0, b = 0; k < packets; k++, s += packet_bytes, b += samples)
+        {
+            // 120 samples: 7 full vectors and 8 lanes of an eighth
+            for (j = 0; j < samples; j += 16)
+            {
+                __mmask16 lanes = j + 16 <= samples ? 0xFFFF : 0x00FF;
+                __m128i v8 = lanes == 0xFFFF ? _mm_loadu_si128((const __m128i*)(s + j))
+                                             : _mm_loadl_epi64((const __m128i*)(s + j));
+                __m512 x = _mm512_maskz_cvtepi32_ps(0xFFFF, _mm512_maskz_cvtepu8_epi32(0xFFFF, v8));
+                __m512 m = _mm512_maskz_loadu_ps(lanes, mean + b + j);
+                __m512 d = _mm512_sub_ps(x, m);
+                __m512 step = _mm512_mul_ps(a, d);
+                __m512 v = _mm512_maskz_loadu_ps(lanes, variance + b + j);
+                v = _mm512_add_ps(v, _mm512_mul_ps(d, step));
+                _mm512_mask_storeu_ps(mean + b + j, lanes, _mm512_add_ps(m, step));
+                _mm512_mask_storeu_ps(variance + b + j, lanes, _mm512_mul_ps(keep, v));
+            }
+            minmax_sse41(s, mn + b, mx + b);
+        }
+    }
+}
+
+#endif // DRAGON_X86
+
+// indexed by isa
+static const statistics_ops ops[] =
+{
+    { moments_scalar, weighted_scalar },
+#ifdef DRAGON_X86
+    { moments_sse41, weighted_sse41 },
+    { moments_avx2, weighted_avx2 },
+    { moments_avx512, weighted_avx512 },
+#endif
+};
+
+static const statistics_ops& active_ops()
+{
+    size_t i = static_cast<size_t>(active_isa());
+    return i < sizeof(ops)/sizeof(ops[0]) ? ops[i] : ops[0];
+}
+
+// 128-bit unsigned integer as two halves: unsigned __int128 is missing on
+// 32-bit targets
+struct uint128
+{
+    uint64_t hi;
+    uint64_t lo;
+};
+
+static uint128 multiply(uint64_t a, uint64_t b)
+{
+    uint64_t a0 = (uint32_t)a, a1 = a >> 32;
+    uint64_t b0 = (uint32_t)b, b1 = b >> 32;
+    uint64_t p00 = a0*b0, p01 = a0*b1, p10 = a1*b0;
+    uint64_t middle = (p00 >> 32) + (uint32_t)p01 + (uint32_t)p10;
+    uint128 r;
+
+    r.lo = middle << 32 | (uint32_t)p00;
+    r.hi = a1*b1 + (p01 >> 32) + (p10 >> 32) + (middle >> 32);
+    return r;
+}
+
+// a - b for a >= b
+static uint128 subtract(uint128 a, uint128 b)
+{
+    uint128 r;
+
+    r.lo = a.lo - b.lo;
+    r.hi = a.hi - b.hi - (a.lo < b.lo);
+    return r;
+}
+
+static double to_double(uint128 a)
+{
+    return (double)a.hi*18446744073709551616.0 + (double)a.lo;
+}
+
+bin_statistics::bin_statistics(uint32_t frame_length, const statistics_options& options)
+    : options_(options), published_(0)
+{
+    frame_packets_ = frame_length ? (frame_length - 1)/samples + 1 : 1;
+    frame_length_ = frame_packets_*samples;
+    frame_bytes_ = frame_packets_*packet_bytes;
+
+    options_.step = std::min(std::max<uint32_t>(options_.step, 1), max_step);
+    options_.alpha = std::min(std::max(options_.alpha, 0.0f), 1.0f);
+    exponential_ = options_.alpha > 0;
+
+    // the window's steps plus the one being filled
+    slots_ = 1;
+    if (!exponential_ && options_.window)
+        slots_ = (options_.window - 1)/options_.step + 2;
+
+    sum_.resize(slots_*frame_length_);
+    square_.resize(slots_*frame_length_);
+    min_.resize(slots_*frame_length_);
+    max_.resize(slots_*frame_length_);
+    total_sum_.resize(frame_length_);
+    total_square_.resize(frame_length_);
+    if (exponential_)
+    {
+        ew_mean_.resize(frame_length_);
+        ew_variance_.resize(frame_length_);
+    }
+
+    reset();
+}
+
+void bin_statistics::reset()
+{
+    std::fill(sum_.begin(), sum_.end(), 0);
+    std::fill(square_.begin(), square_.end(), 0);
+    std::fill(min_.begin(), min_.end(), 0xFF);
+    std::fill(max_.begin(), max_.end(), 0);
+    std::fill(total_sum_.begin(), total_sum_.end(), 0);
+    std::fill(total_square_.begin(), total_square_.end(), 0);
+    std::fill(ew_mean_.begin(), ew_mean_.end(), 0);
+    std::fill(ew_variance_.begin(), ew_variance_.end(), 0);
+    head_ = 0;
+    filled_ = 0;
+    total_frames_ = 0;
+    frames_ = 0;
+    in_step_ = 0;
+    published_ = 0;
+
+    std::lock_guard<std::mutex> guard(snapshot_lock_);
+    latest_.reset();
+}
+
+std::shared_ptr<const statistics_snapshot> bin_statistics::snapshot() const
+{
+    std::lock_guard<std::mutex> guard(snapshot_lock_);
+    return latest_;
+}
+
+void bin_statistics::add(const uint8_t* packets, size_t bytes)
+{
+    add_frames(packets, bytes/frame_bytes_, frame_bytes_);
+}
+
+void bin_statistics::add_frames(const uint8_t* first, size_t left, size_t stride)
+{
+    const statistics_ops& o = active_ops();
+    size_t slot = head_*frame_length_;
+    size_t k, n, b;
+
+    // exponential weighting starts from the first frame
+    if (exponential_ && !frames_ && left)
+    {
+        for (b = 0; b < frame_length_; b++)
+            ew_mean_[b] = first[b/samples*packet_bytes + header_bytes + b%samples];
+    }
+
+    while (left)
+    {
+        uint32_t count = std::min<uint64_t>(left, options_.step - in_step_);
+
+        for (k = 0; k < frame_packets_; k += n)
+        {
+            n = std::min(tile_packets, frame_packets_ - k);
+            b = slot + k*samples;
+            if (exponential_)
+                o.weighted(first + k*packet_bytes, count, stride, n, options_.alpha,
+                           &ew_mean_[k*samples], &ew_variance_[k*samples], &min_[b], &max_[b]);
+            else
+                o.moments(first + k*packet_bytes, count, stride, n,
+                          &sum_[b], &square_[b], &min_[b], &max_[b]);
+        }
+
+        first += count*stride;
+        left -= count;
+        frames_ += count;
+        in_step_ += count;
+        if (in_step_ == options_.step)
+        {
+            end_step();
+            slot = head_*frame_length_;
+        }
+    }
+}
+
+void bin_statistics::end_step()
+{
+    size_t slot = head_*frame_length_;
+    size_t b;
+
+    in_step_ = 0;
+    if (exponential_)
+    {
+        publish();
+        return;
+    }
+
+    for (b = 0; b < frame_length_; b++)
+    {
+        total_sum_[b] += sum_[slot + b];
+        total_square_[b] += square_[slot + b];
+    }
+    total_frames_ += options_.step;
+
+    if (slots_ == 1)
+    {
+        // all frames since reset: min and max carry on
+        std::fill(sum_.begin(), sum_.end(), 0);
+        std::fill(square_.begin(), square_.end(), 0);
+        publish();
+        return;
+    }
+
+    // the step leaving the window gives its slot to the next one
+    head_ = (head_ + 1) % slots_;
+    slot = head_*frame_length_;
+    if (++filled_ == slots_)
+    {
+        for (b = 0; b < frame_length_; b++)
+        {
+            total_sum_[b] -= sum_[slot + b];
+            total_square_[b] -= square_[slot + b];
+        }
+        total_frames_ -= options_.step;
+        filled_--;
+    }
+    std::fill(&sum_[slot], &sum_[slot] + frame_length_, 0);
+    std::fill(&square_[slot], &square_[slot] + frame_length_, 0);
+    std::fill(&min_[slot], &min_[slot] + frame_length_, 0xFF);
+    std::fill(&max_[slot], &max_[slot] + frame_length_, 0);
+
+    publish();
+}
+
+void bin_statistics::publish()
+{
+    // a new one each step: readers may hold the old one for any time
+    std::shared_ptr<statistics_snapshot> s = std::make_shared<statistics_snapshot>();
+    size_t b, i;
+
+    s->index = ++published_;
+    s->min.assign(min_.begin(), min_.begin() + frame_length_);
+    s->max.assign(max_.begin(), max_.begin() + frame_length_);
+
+    // end_step() cleared the slot being filled, it doesn't change the result
+    for (i = 1; i < slots_; i++)
+    {
+        const uint8_t* mn = &min_[i*frame_length_];
+        const uint8_t* mx = &max_[i*frame_length_];
+        for (b = 0; b < frame_length_; b++)
+        {
+            s->min[b] = std::min(s->min[b], mn[b]);
+            s->max[b] = std::max(s->max[b], mx[b]);
+        }
+    }
+
+    if (exponential_)
+    {
+        s->frames = frames_;
+        s->mean = ew_mean_;
+        s->variance = ew_variance_;
+    }
+    else
+    {
+        // n*Q - S^2 exactly, then rounded
+        double nn = (double)total_frames_*total_frames_;
+
+        s->frames = total_frames_;
+        s->mean.resize(frame_length_);
+        s->variance.resize(frame_length_);
+        for (b = 0; b < frame_length_; b++)
+        {
+            uint128 spread = subtract(multiply(total_frames_, total_square_[b]),
+                                      multiply(total_sum_[b], total_sum_[b]));
+            s->mean[b] = (float)((double)total_sum_[b]/total_frames_);
+            s->variance[b] = (float)(to_double(spread)/nn);
+        }
+    }
+
+    // the previous snapshot is dropped after unlocking
+    std::shared_ptr<const statistics_snapshot> previous(std::move(s));
+    std::lock_guard<std::mutex> guard(snapshot_lock_);
+    latest_.swap(previous);
+}
+
+} // namespace dragon
@@ -0,0 +1,114 @@
+// libdragon: running per-bin statistics of frames
+//
+// bin_statistics keeps the mean, variance, minimum and maximum of every bin
+// over all frames since reset, over a sliding window, or exponentially
+// weighted, reading the samples from the packets in one pass. Every `step`
+// frames a snapshot is published which other threads can pick up while
+// frames keep being added.
+//
+// The 8-bit samples allow exact integer sums of values and squares, so
+// all-frame and sliding variances are computed without rounding, and the
+// window slides by subtracting whole steps. Exponential weighting uses the
+// incremental (Welford-style) update in float.
+
+#ifndef DRAGON_STATISTICS_HPP
+#define DRAGON_STATISTICS_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "dragon_demux.hpp"
+#include "dragon_stream.hpp"
+
+namespace dragon
+{
+
+struct statistics_options
+{
+    uint64_t window = 0;    // sliding window in frames, rounded up to whole
+                            // steps; 0 - all frames since reset
+    uint32_t step = 1024;   // frames between snapshots and window moves,
+                            // 1 to 65536
+    float alpha = 0;        // weight of a new frame for exponential
+                            // weighting, 0 to 1; 0 - off. Min and max then
+                            // hold since reset.
+};
+
+struct statistics_snapshot
+{
+    uint64_t index;         // snapshots published since reset, from 1
+    uint64_t frames;        // frames covered, all added for exponential
+    std::vector<float> mean;
+    std::vector<float> variance;    // population variance
+    std::vector<uint8_t> min;
+    std::vector<uint8_t> max;
+};
+
+class bin_statistics
+{
+public:
+    // frame_length is rounded up to whole packets as the driver does
+    bin_statistics(uint32_t frame_length,
+                   const statistics_options& options = statistics_options());
+
+    bin_statistics(const bin_statistics&) = delete;
+    bin_statistics& operator=(const bin_statistics&) = delete;
+
+    // add the whole frames in `bytes` of buffer data
+    void add(const uint8_t* packets, size_t bytes);
+    void add(const lease& buf) { add(buf.data(), buf.size()); }
+    // add the frames of one channel of a buffer
+    void add(const channel_view& view) { add_frames(view.first, view.frames, view.stride); }
+
+    // Latest snapshot, empty before the first step completes. Safe to call
+    // from any thread; the snapshot stays valid while it is held.
+    std::shared_ptr<const statistics_snapshot> snapshot() const;
+
+    void reset();
+
+    uint32_t frame_length() const { return frame_length_; }
+
+private:
+    void add_frames(const uint8_t* first, size_t frames, size_t stride);
+    void end_step();
+    void publish();
+
+    uint32_t frame_length_;
+    size_t frame_packets_;
+    size_t frame_bytes_;
+    statistics_options options_;
+    bool exponential_;
+
+    // one slot per step in the window (one without a window); each holds
+    // the 32-bit sums, squares, min and max of its step
+    size_t slots_;
+    size_t head_;
+    size_t filled_;
+    std::vector<uint32_t> sum_;
+    std::vector<uint32_t> square_;
+    std::vector<uint8_t> min_;
+    std::vector<uint8_t> max_;
+    // totals of the completed steps in the window
+    std::vector<uint64_t> total_sum_;
+    std::vector<uint64_t> total_square_;
+    uint64_t total_frames_;
+
+    // exponential weighting
+    std::vector<float> ew_mean_;
+    std::vector<float> ew_variance_;
+
+    uint64_t frames_;       // added since reset
+    uint32_t in_step_;
+    uint64_t published_;
+
+    mutable std::mutex snapshot_lock_;
+    std::shared_ptr<const statistics_snapshot> latest_;
+};
+
+} // namespace dragon
+
+#endif // DRAGON_STATISTICS_HPP
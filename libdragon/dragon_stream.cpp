@@ -0,0 +1,253 @@
+#include "dragon_stream.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <system_error>
+
+namespace dragon
+{
+
+static void throw_errno(const char* what)
+{
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+lease& lease::operator=(lease&& other)
+{
+    if (this != &other)
+    {
+        release();
+        ring_ = other.ring_;
+        buf_ = other.buf_;
+        data_ = other.data_;
+        other.ring_ = 0;
+    }
+    return *this;
+}
+
+void lease::release()
+{
+    if (ring_)
+    {
+        ring_->queue(buf_->idx);
+        ring_ = 0;
+    }
+}
+
+buffer_ring::iterator& buffer_ring::iterator::operator++()
+{
+    // releasing the previous lease first keeps the device queue full
+    current_ = lease();
+    while (ring_)
+    {
+        current_ = ring_->next();
+        if (current_)
+            break;
+        if (!ring_->active_)
+            ring_ = 0;
+    }
+    return *this;
+}
+
+buffer_ring::buffer_ring(const char* path, const dragon_params& params,
+                         const ring_options& options)
+    : fd_(-1), params_(params), options_(options), base_(0), map_size_(0),
+      active_(false), completed_pos_(0), completed_count_(0), pending_count_(0)
+{
+    dragon_request request;
+    size_t i;
+
+    fd_ = open(path, O_RDWR);
+    if (fd_ < 0)
+        throw_errno("open");
+
+    try
+    {
+        if (ioctl(fd_, DRAGON_SET_PARAMS, &params_))
+            throw_errno("DRAGON_SET_PARAMS");
+        if (ioctl(fd_, DRAGON_QUERY_PARAMS, &params_))
+            throw_errno("DRAGON_QUERY_PARAMS");
+
+        memset(&request, 0, sizeof(request));
+        request.count = options_.buffers;
+        request.flags = options_.request_flags;
+        if (options_.node >= 0)
+        {
+            request.flags |= DRAGON_REQUEST_NODE;
+            request.node = options_.node;
+        }
+        if (ioctl(fd_, DRAGON_REQUEST_BUFFERS_EX, &request))
+            throw_errno("DRAGON_REQUEST_BUFFERS_EX");
+        // no buffers requested, or none could be allocated
+        if (!request.count)
+            throw std::system_error(ENOMEM, std::generic_category(),
+                                    "DRAGON_REQUEST_BUFFERS_EX");
+
+        buffers_.resize(request.count);
+        for (i = 0; i < buffers_.size(); i++)
+        {
+            memset(&buffers_[i], 0, sizeof(dragon_buffer));
+            buffers_[i].idx = i;
+            if (ioctl(fd_, DRAGON_QUERY_BUFFER, &buffers_[i]))
+                throw_errno("DRAGON_QUERY_BUFFER");
+        }
+
+        // buffers lie back to back, one mapping covers them all
+        map_size_ = buffers_.back().offset + buffers_.back().len;
+        map_size_ = (map_size_ + getpagesize() - 1) & ~(size_t)(getpagesize() - 1);
+        void* base = mmap(0, map_size_, PROT_READ, MAP_SHARED, fd_, 0);
+        if (base == MAP_FAILED)
+            throw_errno("mmap");
+        base_ = static_cast<uint8_t*>(base);
+
+        if (ioctl(fd_, DRAGON_SET_OVERWRITE, (int)options_.overwrite))
+            throw_errno("DRAGON_SET_OVERWRITE");
+
+        if (!options_.batch)
+            options_.batch = 1;
+        completed_.resize(std::min<size_t>(options_.batch, buffers_.size()));
+        pending_.resize(buffers_.size());
+        leased_.assign(buffers_.size(), false);
+    }
+    catch (...)
+    {
+        if (base_)
+            munmap(base_, map_size_);
+        close(fd_);
+        throw;
+    }
+}
+
+buffer_ring::~buffer_ring()
+{
+    stop();
+    munmap(base_, map_size_);
+    close(fd_);
+}
+
+void buffer_ring::start()
+{
+    dragon_buffer_multi multi;
+    size_t i;
+
+    if (active_)
+        return;
+
+    if (ioctl(fd_, DRAGON_SET_ACTIVITY, 1))
+        throw_errno("DRAGON_SET_ACTIVITY");
+    active_ = true;
+
+    // after REQUEST_BUFFERS or a stop every buffer not leased is ours
+    pending_count_ = 0;
+    completed_pos_ = completed_count_ = 0;
+    for (i = 0; i < buffers_.size(); i++)
+    {
+        if (!leased_[i])
+            pending_[pending_count_++].idx = i;
+    }
+
+    multi.buffers = pending_.data();
+    multi.count = pending_count_;
+    multi.timeout_ms = 0;
+    if (ioctl(fd_, DRAGON_QBUF_MULTI, &multi))
+        throw_errno("DRAGON_QBUF_MULTI");
+    pending_count_ = 0;
+}
+
+void buffer_ring::stop()
+{
+    dragon_buffer_multi multi;
+
+    if (!active_)
+        return;
+
+    // waits for queued buffers to complete
+    ioctl(fd_, DRAGON_SET_ACTIVITY, 0);
+    active_ = false;
+    pending_count_ = 0;
+
+    // take back whatever completed meanwhile, start() queues it again
+    multi.buffers = completed_.data();
+    multi.count = completed_.size();
+    multi.timeout_ms = 0;
+    while (!ioctl(fd_, DRAGON_DQBUF_MULTI, &multi) && multi.count)
+        multi.count = completed_.size();
+    completed_pos_ = completed_count_ = 0;
+}
+
+void buffer_ring::queue(size_t idx)
+{
+    leased_[idx] = false;
+    if (!active_)
+        return;
+
+    pending_[pending_count_++].idx = idx;
+
+    // hand buffers back in batches, but never let the device run short
+    if (pending_count_ >= options_.batch ||
+        completed_pos_ == completed_count_)
+    {
+        flush();
+    }
+}
+
+void buffer_ring::flush()
+{
+    dragon_buffer_multi multi;
+
+    if (!pending_count_)
+        return;
+
+    multi.buffers = pending_.data();
+    multi.count = pending_count_;
+    multi.timeout_ms = 0;
+    // fails with EAGAIN once stopped; the buffers are queued again by start()
+    ioctl(fd_, DRAGON_QBUF_MULTI, &multi);
+    pending_count_ = 0;
+}
+
+bool buffer_ring::refill(int timeout_ms)
+{
+    dragon_buffer_multi multi;
+
+    flush();
+
+    multi.buffers = completed_.data();
+    multi.count = completed_.size();
+    multi.timeout_ms = timeout_ms;
+    if (ioctl(fd_, DRAGON_DQBUF_MULTI, &multi))
+    {
+        // when allowed to wait, EAGAIN means the device was stopped
+        if (errno == EAGAIN && timeout_ms)
+            active_ = false;
+        else if (errno != EAGAIN && errno != ETIMEDOUT && errno != EINTR)
+            throw_errno("DRAGON_DQBUF_MULTI");
+        return false;
+    }
+
+    completed_pos_ = 0;
+    completed_count_ = multi.count;
+    return completed_count_ != 0;
+}
+
+lease buffer_ring::next(int timeout_ms)
+{
+    if (completed_pos_ == completed_count_ && !refill(timeout_ms))
+        return lease();
+
+    // per-completion fields go to the buffer's own slot, which stays
+    // untouched until the lease is released
+    const dragon_buffer& done = completed_[completed_pos_++];
+    dragon_buffer& buf = buffers_[done.idx];
+    buf = done;
+    leased_[done.idx] = true;
+
+    return lease(this, &buf, base_ + buf.offset);
+}
+
+} // namespace dragon
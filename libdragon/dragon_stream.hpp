@@ -0,0 +1,172 @@
+// libdragon: userspace streaming over the dragon ioctl ABI
+//
+// buffer_ring opens a board, applies params, requests and maps all buffers
+// once and keeps them queued. Completed buffers are handed out as leases
+// which queue the buffer back when destroyed. Nothing is allocated per
+// buffer on the hot path: completions are dequeued and released buffers
+// queued in batches.
+
+#ifndef DRAGON_STREAM_HPP
+#define DRAGON_STREAM_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+
+#include <iterator>
+#include <vector>
+
+#include "../dragon.h"
+
+namespace dragon
+{
+
+class buffer_ring;
+
+// A completed buffer owned by the consumer until the lease is destroyed or
+// released. Leases are move-only and must not outlive their ring.
+class lease
+{
+public:
+    lease() : ring_(0), buf_(0), data_(0) {}
+    lease(lease&& other) : ring_(other.ring_), buf_(other.buf_), data_(other.data_)
+    {
+        other.ring_ = 0;
+    }
+    lease& operator=(lease&& other);
+    ~lease() { release(); }
+
+    lease(const lease&) = delete;
+    lease& operator=(const lease&) = delete;
+
+    explicit operator bool() const { return ring_ != 0; }
+
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return buf_->len; }
+    size_t index() const { return buf_->idx; }
+    uint64_t sequence() const { return buf_->sequence; }
+    uint64_t completed_ns() const { return buf_->completed_ns; }
+    uint32_t flags() const { return buf_->flags; }
+
+    // queue the buffer back now instead of on destruction
+    void release();
+
+private:
+    friend class buffer_ring;
+    lease(buffer_ring* ring, const dragon_buffer* buf, const uint8_t* data)
+        : ring_(ring), buf_(buf), data_(data) {}
+
+    buffer_ring* ring_;
+    const dragon_buffer* buf_;
+    const uint8_t* data_;
+};
+
+struct ring_options
+{
+    size_t buffers = DRAGON_MAX_BUFFER_COUNT; // clamped by the driver
+    uint32_t request_flags = 0;               // DRAGON_REQUEST_* flags
+    int node = -1;                            // NUMA node, -1 for the board's
+    bool overwrite = false;                   // DRAGON_SET_OVERWRITE
+    uint32_t batch = DRAGON_MAX_BUFFER_COUNT; // buffers dequeued per ioctl
+};
+
+class buffer_ring
+{
+public:
+    // Open the device and set it up; throws std::system_error
+    buffer_ring(const char* path, const dragon_params& params,
+                const ring_options& options = ring_options());
+    ~buffer_ring();
+
+    buffer_ring(const buffer_ring&) = delete;
+    buffer_ring& operator=(const buffer_ring&) = delete;
+
+    // queue every buffer and enable acquisition
+    void start();
+    // disable acquisition; outstanding leases stay valid
+    void stop();
+
+    // Next completed buffer, waiting up to timeout_ms (negative - forever).
+    // Returns an empty lease on timeout or once the device is stopped.
+    lease next(int timeout_ms = -1);
+
+    // Call f(lease&) for every completed buffer until it returns false or
+    // the device is stopped
+    template <class F>
+    void for_each(F f, int timeout_ms = -1)
+    {
+        for (;;)
+        {
+            lease l = next(timeout_ms);
+            if (!l)
+            {
+                if (!active_)
+                    return;
+                continue;
+            }
+            if (!f(l))
+                return;
+        }
+    }
+
+    // Blocking input iteration: for (auto& l : ring) { ... }
+    class iterator
+    {
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef lease value_type;
+        typedef ptrdiff_t difference_type;
+        typedef lease* pointer;
+        typedef lease& reference;
+
+        iterator() : ring_(0) {}
+        explicit iterator(buffer_ring* ring) : ring_(ring) { ++*this; }
+
+        lease& operator*() { return current_; }
+        lease* operator->() { return &current_; }
+        iterator& operator++();
+        bool operator==(const iterator& other) const { return ring_ == other.ring_; }
+        bool operator!=(const iterator& other) const { return ring_ != other.ring_; }
+
+    private:
+        buffer_ring* ring_;
+        lease current_;
+    };
+
+    iterator begin() { return iterator(this); }
+    iterator end() { return iterator(); }
+
+    int fd() const { return fd_; }
+    size_t buffer_count() const { return buffers_.size(); }
+    const dragon_params& params() const { return params_; }
+
+    // pointer to a buffer's payload in the shared mapping
+    const uint8_t* data(size_t idx) const { return base_ + buffers_[idx].offset; }
+
+private:
+    friend class lease;
+
+    void queue(size_t idx);
+    void flush();
+    bool refill(int timeout_ms);
+
+    int fd_;
+    dragon_params params_;
+    ring_options options_;
+    uint8_t* base_;
+    size_t map_size_;
+    bool active_;
+
+    std::vector<dragon_buffer> buffers_;    // as queried, indexed by idx
+    std::vector<dragon_buffer> completed_;  // last DQBUF_MULTI batch
+    size_t completed_pos_;
+    size_t completed_count_;
+    std::vector<dragon_buffer> pending_;    // released, not yet queued
+    size_t pending_count_;
+    std::vector<bool> leased_;
+};
+
+} // namespace dragon
+
+#endif // DRAGON_STREAM_HPP
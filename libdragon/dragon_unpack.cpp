@@ -0,0 +1,270 @@
+#include "dragon_unpack.hpp"
+#include "dragon_cpu.hpp"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DRAGON_X86 1
+#include <immintrin.h>
+#endif
+
+namespace dragon
+{
+
+static const size_t packet_bytes = DRAGON_PACKET_SIZE_BYTES;
+static const size_t header_bytes = DRAGON_PACKET_HEADER_BYTES;
+static const size_t samples = DRAGON_DATA_PER_PACKET;
+
+typedef void (*unpack_u8_fn)(const uint8_t*, size_t, uint8_t*);
+typedef void (*unpack_s16_fn)(const uint8_t*, size_t, int16_t*);
+typedef void (*unpack_f32_fn)(const uint8_t*, size_t, float*);
+
+struct unpack_ops
+{
+    unpack_u8_fn u8;
+    unpack_s16_fn s16;
+    unpack_f32_fn f32;
+};
+
+static void unpack_u8_scalar(const uint8_t* p, size_t packets, uint8_t* out)
+{
+    for (; packets; packets--, p += packet_bytes, out += samples)
+        memcpy(out, p + header_bytes, samples);
+}
+
+template <class T>
+static void unpack_wide_scalar(const uint8_t* p, size_t packets, T* out)
+{
+    size_t j;
+
+    for (; packets; packets--, p += packet_bytes, out += samples)
+    {
+        for (j = 0; j < samples; j++)
+            out[j] = p[header_bytes + j];
+    }
+}
+
+#ifdef DRAGON_X86
+
+// The 120 samples aren't a multiple of the vector width; the last vector of
+// a packet is taken to end at the packet end and overlaps the one before.
+
+__attribute__((target("sse4.1")))
+static void unpack_u8_sse41(const uint8_t* p, size_t packets, uint8_t* out)
+{
+    size_t j;
+
+    for (; packets; packets--, p += packet_bytes, out += samples)
+    {
+        const uint8_t* s = p + header_bytes;
+        for (j = 0; j + 16 <= samples; j += 16)
+            _mm_storeu_si128((__m128i*)(out + j), _mm_loadu_si128((const __m128i*)(s + j)));
+        j = samples - 16;
+        _mm_storeu_si128((__m128i*)(out + j), _mm_loadu_si128((const __m128i*)(s + j)));
+    }
+}
+
+__attribute__((target("sse4.1")))
+static void unpack_s16_sse41(const uint8_t* p, size_t packets, int16_t* out)
+{
+    size_t j;
+
+    for (; packets; packets--, p += packet_bytes, out += samples)
+    {
+        const uint8_t* s = p + header_bytes;
+        for (j = 0; j < samples; j += 8)
+        {
+            __m128i v = _mm_loadl_epi64((const __m128i*)(s + j));
+            _mm_storeu_si128((__m128i*)(out + j), _mm_cvtepu8_epi16(v));
+        }
+    }
+}
+
+__attribute__((target("sse4.1")))
+static void unpack_f32_sse41(const uint8_t* p, size_t packets, float* out)
+{
+    size_t j;
+
+    for (; packets; packets--, p += packet_bytes, out += samples)
+    {
+        const uint8_t* s = p + header_bytes;
+        for (j = 0; j < samples; j += 4)
+        {
+            int32_t word;
+            memcpy(&word, s + j, 4);
+            __m128i v = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(word));
+            _mm_storeu_ps(out + j, _mm_cvtepi32_ps(v));
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void unpack_u8_avx2(const uint8_t* p, size_t packets, uint8_t* out)
+{
+    size_t j;
+
+    for (; packets; packets--, p += packet_bytes, out += samples)
+    {
+        const uint8_t* s = p + header_bytes;
+        for (j = 0; j + 32 <= samples; j += 32)
+            _mm256_storeu_si256((__m256i*)(out + j), _mm256_loadu_si256((const __m256i*)(s + j)));
+        j = samples - 32;
+        _mm256_storeu_si256((__m256i*)(out + j), _mm256_loadu_si256((const __m256i*)(s + j)));
+    }
+}
+
+__attribute__((target("avx2")))
+static void unpack_s16_avx2(const uint8_t* p, size_t packets, int16_t* out)
+{
+    size_t j;
+
+    for (; packets; packets--, p += packet_bytes, out += samples)
+    {
+        const uint8_t* s = p + header_bytes;
+        for (j = 0; j + 16 <= samples; j += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(s + j));
+            _mm256_storeu_si256((__m256i*)(out + j), _mm256_cvtepu8_epi16(v));
+        }
+        j = samples - 16;
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + j));
+        _mm256_storeu_si256((__m256i*)(out + j), _mm256_cvtepu8_epi16(v));
+    }
+}
+
+__attribute__((target("avx2")))
+static void unpack_f32_avx2(const uint8_t* p, size_t packets, float* out)
+{
+    size_t j;
+
+    for (; packets; packets--, p += packet_bytes, out += samples)
+    {
+        const uint8_t* s = p + header_bytes;
+        for (j = 0; j < samples; j += 8)
+        {
+            __m128i v = _mm_loadl_epi64((const __m128i*)(s + j));
+            _mm256_storeu_ps(out + j, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v)));
+        }
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void unpack_u8_avx512(const uint8_t* p, size_t packets, uint8_t* out)
+{
+    for (; packets; packets--, p += packet_bytes, out += samples)
+    {
+        const uint8_t* s = p + header_bytes;
+        _mm512_storeu_si512(out, _mm512_loadu_si512(s));
+        _mm512_storeu_si512(out + samples - 64, _mm512_loadu_si512(s + samples - 64));
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void unpack_s16_avx512(const uint8_t* p, size_t packets, int16_t* out)
+{
+    size_t j;
+
+    for (; packets; packets--, p += packet_bytes, out += samples)
+    {
+        const uint8_t* s = p + header_bytes;
+        for (j = 0; j + 32 <= samples; j += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(s + j));
+            _mm512_storeu_si512(out + j, _mm512_cvtepu8_epi16(v));
+        }
+        j = samples - 32;
+        __m256i v = _mm256_loadu_si256((const __m256i*)(s + j));
+        _mm512_storeu_si512(out + j, _mm512_cvtepu8_epi16(v));
+    }
+}
+
+// the all-ones masks avoid gcc 12 warning about its own _mm512_undefined
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512 f32x16(__m128i v)
+{
+    return _mm512_maskz_cvtepi32_ps(0xFFFF, _mm512_maskz_cvtepu8_epi32(0xFFFF, v));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void unpack_f32_avx512(const uint8_t* p, size_t packets, float* out)
+{
+    size_t j;
+
+    for (; packets; packets--, p += packet_bytes, out += samples)
+    {
+        const uint8_t* s = p + header_bytes;
+        for (j = 0; j + 16 <= samples; j += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(s + j));
+            _mm512_storeu_ps(out + j, f32x16(v));
+        }
+        j = samples - 16;
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + j));
+        _mm512_storeu_ps(out + j, f32x16(v));
+    }
+}
+
+#endif // DRAGON_X86
+
+// indexed by isa
+static const unpack_ops ops[] =
+{
+    { unpack_u8_scalar, unpack_wide_scalar<int16_t>, unpack_wide_scalar<float> },
+#ifdef DRAGON_X86
+    { unpack_u8_sse41, unpack_s16_sse41, unpack_f32_sse41 },
+    { unpack_u8_avx2, unpack_s16_avx2, unpack_f32_avx2 },
+    { unpack_u8_avx512, unpack_s16_avx512, unpack_f32_avx512 },
+#endif
+};
+
+static const unpack_ops& active_ops()
+{
+    size_t i = static_cast<size_t>(active_isa());
+    return i < sizeof(ops)/sizeof(ops[0]) ? ops[i] : ops[0];
+}
+
+size_t unpack(const uint8_t* packets, size_t bytes, uint8_t* out)
+{
+    active_ops().u8(packets, bytes/packet_bytes, out);
+    return unpacked_samples(bytes);
+}
+
+size_t unpack(const uint8_t* packets, size_t bytes, int16_t* out)
+{
+    active_ops().s16(packets, bytes/packet_bytes, out);
+    return unpacked_samples(bytes);
+}
+
+size_t unpack(const uint8_t* packets, size_t bytes, float* out)
+{
+    active_ops().f32(packets, bytes/packet_bytes, out);
+    return unpacked_samples(bytes);
+}
+
+template <class T, class F>
+static size_t unpack_view(const channel_view& view, T* out, F fn)
+{
+    size_t packets = view.frame_bytes/packet_bytes;
+    size_t f;
+
+    for (f = 0; f < view.frames; f++, out += packets*samples)
+        fn(view.frame(f), packets, out);
+    return view.frames*packets*samples;
+}
+
+size_t unpack(const channel_view& view, uint8_t* out)
+{
+    return unpack_view(view, out, active_ops().u8);
+}
+
+size_t unpack(const channel_view& view, int16_t* out)
+{
+    return unpack_view(view, out, active_ops().s16);
+}
+
+size_t unpack(const channel_view& view, float* out)
+{
+    return unpack_view(view, out, active_ops().f32);
+}
+
+} // namespace dragon
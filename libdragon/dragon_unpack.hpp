@@ -0,0 +1,40 @@
+// libdragon: stripping packet headers from buffers
+//
+// The device writes a frame as consecutive 128-byte packets, each holding an
+// 8-byte header and 120 one-byte samples. unpack() copies the samples of a
+// whole buffer into one contiguous array, frame after frame, and can widen
+// them to int16_t or float in the same pass so the data is read only once.
+
+#ifndef DRAGON_UNPACK_HPP
+#define DRAGON_UNPACK_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dragon_demux.hpp"
+
+namespace dragon
+{
+
+// samples carried by `bytes` of packets
+inline size_t unpacked_samples(size_t bytes)
+{
+    return bytes/DRAGON_PACKET_SIZE_BYTES*DRAGON_DATA_PER_PACKET;
+}
+
+// Unpack the whole packets in `bytes` of buffer data into out, which must
+// hold unpacked_samples(bytes) elements; returns the samples written.
+// Frame f then starts at out + f*frame_length.
+size_t unpack(const uint8_t* packets, size_t bytes, uint8_t* out);
+size_t unpack(const uint8_t* packets, size_t bytes, int16_t* out);
+size_t unpack(const uint8_t* packets, size_t bytes, float* out);
+
+// Unpack the frames of one channel, back to back, into out, which must hold
+// view.frames*frame_length elements; returns the samples written
+size_t unpack(const channel_view& view, uint8_t* out);
+size_t unpack(const channel_view& view, int16_t* out);
+size_t unpack(const channel_view& view, float* out);
+
+} // namespace dragon
+
+#endif // DRAGON_UNPACK_HPP
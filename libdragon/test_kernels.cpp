@@ -0,0 +1,319 @@
+// libdragon: checks every SIMD variant of the data kernels against
+// isa::scalar on random data and lengths, and the channel phase tracking of
+// channel_demux; run with `make test`
+
+#include "dragon_accumulate.hpp"
+#include "dragon_cpu.hpp"
+#include "dragon_demux.hpp"
+#include "dragon_statistics.hpp"
+#include "dragon_unpack.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <random>
+#include <vector>
+
+using namespace dragon;
+
+static std::mt19937 rng(20240611);
+static int failures = 0;
+
+static void check(bool ok, const char* name, const char* what, size_t iteration)
+{
+    if (ok)
+        return;
+    printf("FAIL %s: %s, iteration %zu\n", name, what, iteration);
+    failures++;
+}
+
+static void check(bool ok, isa i, const char* what, size_t iteration)
+{
+    check(ok, isa_name(i), what, iteration);
+}
+
+static std::vector<uint8_t> random_bytes(size_t n)
+{
+    std::vector<uint8_t> v(n);
+    for (size_t i = 0; i < n; i++)
+        v[i] = static_cast<uint8_t>(rng());
+    return v;
+}
+
+// Unpack into out with guard elements after the samples, so writes past
+// the end show up as mismatches as well
+template <class T>
+static std::vector<T> unpack_guarded(const std::vector<uint8_t>& packets,
+                                     size_t bytes)
+{
+    std::vector<T> out(unpacked_samples(bytes) + 64, T(77));
+    unpack(packets.data(), bytes, out.data());
+    return out;
+}
+
+template <class T>
+static std::vector<T> unpack_guarded(const channel_view& view)
+{
+    size_t n = view.frames*view.frame_bytes/DRAGON_PACKET_SIZE_BYTES*
+               DRAGON_DATA_PER_PACKET;
+    std::vector<T> out(n + 64, T(77));
+    unpack(view, out.data());
+    return out;
+}
+
+template <class T>
+static bool same(const std::vector<T>& a, const std::vector<T>& b)
+{
+    return a.size() == b.size() && !memcmp(a.data(), b.data(), a.size()*sizeof(T));
+}
+
+static void test_unpack(isa i)
+{
+    for (size_t it = 0; it < 1000; it++)
+    {
+        // whole packets plus a partial one that must be ignored
+        size_t bytes = rng() % 300*DRAGON_PACKET_SIZE_BYTES +
+                       rng() % DRAGON_PACKET_SIZE_BYTES;
+        std::vector<uint8_t> packets = random_bytes(bytes + 1);
+
+        set_isa(isa::scalar);
+        std::vector<uint8_t> ref8 = unpack_guarded<uint8_t>(packets, bytes);
+        std::vector<int16_t> ref16 = unpack_guarded<int16_t>(packets, bytes);
+        std::vector<float> reff = unpack_guarded<float>(packets, bytes);
+
+        set_isa(i);
+        check(same(unpack_guarded<uint8_t>(packets, bytes), ref8), i, "unpack u8", it);
+        check(same(unpack_guarded<int16_t>(packets, bytes), ref16), i, "unpack s16", it);
+        check(same(unpack_guarded<float>(packets, bytes), reff), i, "unpack f32", it);
+
+        // every other frame, as channel_demux hands them out
+        channel_view view;
+        view.first = packets.data();
+        view.frame_bytes = (rng() % 8 + 1)*DRAGON_PACKET_SIZE_BYTES;
+        view.stride = 2*view.frame_bytes;
+        view.frames = bytes >= view.frame_bytes ?
+                      (bytes - view.frame_bytes)/view.stride + 1 : 0;
+
+        set_isa(isa::scalar);
+        ref8 = unpack_guarded<uint8_t>(view);
+        ref16 = unpack_guarded<int16_t>(view);
+        reff = unpack_guarded<float>(view);
+
+        set_isa(i);
+        check(same(unpack_guarded<uint8_t>(view), ref8), i, "channel unpack u8", it);
+        check(same(unpack_guarded<int16_t>(view), ref16), i, "channel unpack s16", it);
+        check(same(unpack_guarded<float>(view), reff), i, "channel unpack f32", it);
+    }
+}
+
+struct accumulate_case
+{
+    uint32_t frame_length;
+    uint64_t depth;
+    unsigned threads;
+    size_t frames_per_buffer;
+    size_t stride;              // frame bytes, or twice that for one channel
+    std::vector<uint8_t> data;
+};
+
+// Averages of the case in the active instruction set, followed by the
+// partial sum's frame count
+static std::vector<float> accumulate(const accumulate_case& c)
+{
+    std::vector<float> averages;
+    accumulator acc(c.frame_length, c.depth,
+                    [&](const float* average, size_t length)
+                    {
+                        averages.insert(averages.end(), average, average + length);
+                    },
+                    c.threads);
+    size_t frame_bytes = c.frame_length/DRAGON_DATA_PER_PACKET*DRAGON_PACKET_SIZE_BYTES;
+    size_t buffer_bytes = c.frames_per_buffer*c.stride;
+
+    for (size_t at = 0; at + buffer_bytes <= c.data.size(); at += buffer_bytes)
+    {
+        if (c.stride == frame_bytes)
+        {
+            acc.add(&c.data[at], buffer_bytes);
+            continue;
+        }
+
+        channel_view view;
+        view.first = &c.data[at];
+        view.frames = c.frames_per_buffer;
+        view.frame_bytes = frame_bytes;
+        view.stride = c.stride;
+        acc.add(view);
+    }
+
+    averages.push_back(static_cast<float>(acc.frames()));
+    return averages;
+}
+
+static void test_accumulate(isa i)
+{
+    for (size_t it = 0; it < 300; it++)
+    {
+        accumulate_case c;
+        c.frame_length = (rng() % 40 + 1)*DRAGON_DATA_PER_PACKET;
+        c.depth = rng() % 120 + 1;
+        c.threads = rng() % 5 + 1;
+        c.frames_per_buffer = rng() % 50 + 1;
+        c.stride = c.frame_length/DRAGON_DATA_PER_PACKET*DRAGON_PACKET_SIZE_BYTES;
+        if (rng() % 2)
+            c.stride *= 2;
+        c.data = random_bytes((rng() % 6 + 1)*c.frames_per_buffer*c.stride);
+
+        set_isa(isa::scalar);
+        std::vector<float> ref = accumulate(c);
+
+        set_isa(i);
+        check(same(accumulate(c), ref), i, "accumulate", it);
+    }
+}
+
+// snapshots of all frames, sliding windows and exponential weighting
+static void test_statistics(isa i)
+{
+    for (size_t it = 0; it < 400; it++)
+    {
+        uint32_t frame_length = (rng() % 20 + 1)*DRAGON_DATA_PER_PACKET;
+        size_t frame_bytes = frame_length/DRAGON_DATA_PER_PACKET*DRAGON_PACKET_SIZE_BYTES;
+        size_t frames_per_buffer = rng() % 9 + 1;
+        std::vector<uint8_t> data =
+            random_bytes((rng() % 12 + 1)*frames_per_buffer*frame_bytes);
+
+        statistics_options options;
+        options.step = rng() % 7 + 1;
+        switch (rng() % 3)
+        {
+        case 1:
+            options.window = rng() % 20 + 1;
+            break;
+        case 2:
+            options.alpha = 0.1f + rng() % 50/100.0f;
+            break;
+        }
+
+        std::shared_ptr<const statistics_snapshot> snapshots[2];
+        for (size_t run = 0; run < 2; run++)
+        {
+            set_isa(run ? i : isa::scalar);
+            bin_statistics stats(frame_length, options);
+            for (size_t at = 0; at < data.size(); at += frames_per_buffer*frame_bytes)
+                stats.add(&data[at], frames_per_buffer*frame_bytes);
+            snapshots[run] = stats.snapshot();
+        }
+
+        const statistics_snapshot* ref = snapshots[0].get();
+        const statistics_snapshot* got = snapshots[1].get();
+        if (!ref || !got)
+        {
+            check(!ref && !got, i, "statistics snapshot", it);
+            continue;
+        }
+        check(got->index == ref->index && got->frames == ref->frames,
+              i, "statistics frames", it);
+        check(same(got->mean, ref->mean), i, "statistics mean", it);
+        check(same(got->variance, ref->variance), i, "statistics variance", it);
+        check(same(got->min, ref->min) && same(got->max, ref->max),
+              i, "statistics min/max", it);
+    }
+}
+
+// Runs of buffers with odd and even frame counts, overwritten buffers
+// (sequence gaps), underruns and restarts. The first header byte of every
+// frame holds its channel, so each view must only see its own.
+static void test_demux()
+{
+    const uint32_t frame_length = 2*DRAGON_DATA_PER_PACKET;
+    const size_t frame_bytes = 2*DRAGON_PACKET_SIZE_BYTES;
+
+    for (size_t it = 0; it < 200; it++)
+    {
+        unsigned first_channel = rng() % 2;
+        channel_demux demux(frame_length, first_channel);
+        uint64_t sequence = 0;
+        uint64_t frame = 0;     // frames the board has sampled since start
+        bool in_sync = true;
+
+        for (size_t b = 0; b < 100; b++)
+        {
+            size_t frames = rng() % 8;
+            uint32_t flags = 0;
+
+            switch (rng() % 8)
+            {
+            case 0:
+                // activity enabled again
+                sequence = 0;
+                frame = 0;
+                in_sync = true;
+                break;
+            case 1:
+                if (!sequence)
+                    break;
+                // frames lost before the buffer, sequence doesn't show it
+                frame += rng() % 5;
+                flags = DRAGON_BUFFER_UNDERRUN;
+                in_sync = false;
+                break;
+            case 2:
+                if (!sequence)
+                    break;
+                // overwritten buffers as long as this one
+                for (size_t gap = rng() % 3 + 1; gap; gap--, sequence++)
+                    frame += frames;
+                break;
+            }
+
+            std::vector<uint8_t> data(frames*frame_bytes);
+            for (size_t f = 0; f < frames; f++)
+                data[f*frame_bytes] = (first_channel + frame + f) & 1;
+
+            channel_view views[2];
+            bool ok = demux.split(data.data(), data.size(), sequence, views, flags);
+            check(ok == in_sync && demux.in_sync() == in_sync, "demux", "sync", it);
+            check(views[0].frames + views[1].frames == frames, "demux", "frames", it);
+
+            for (unsigned c = 0; c < 2 && in_sync; c++)
+            {
+                for (size_t f = 0; f < views[c].frames; f++)
+                    check(*views[c].frame(f) == c, "demux", "channel", it);
+            }
+
+            sequence++;
+            frame += frames;
+        }
+    }
+}
+
+int main()
+{
+    const isa variants[] = { isa::sse41, isa::avx2, isa::avx512 };
+
+    test_demux();
+
+    for (size_t v = 0; v < sizeof(variants)/sizeof(variants[0]); v++)
+    {
+        isa i = variants[v];
+        if (set_isa(i) != i)
+        {
+            printf("skip %s: not supported here\n", isa_name(i));
+            continue;
+        }
+
+        test_unpack(i);
+        test_accumulate(i);
+        test_statistics(i);
+        printf("%s checked\n", isa_name(i));
+    }
+
+    set_isa(supported_isa());
+    if (failures)
+    {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}